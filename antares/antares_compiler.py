@@ -71,8 +71,24 @@ def get_global_arg_props():
     global_arg_props = json.loads(global_arg_props)
   return global_arg_props
 
-def translate_code(code, config):
-  assert(len(code.split('extern "C"')) == 2)
+def get_intermediate_buffers(code, lower_source):
+  # Global buffers that one kernel of the module writes and a later one reads, the evaluator allocates them
+  global_arg_props = get_global_arg_props()
+  arg_names = set([buf['name'] for buf in global_arg_props['_in'] + global_arg_props['_out']])
+  params = []
+  for signature in re.findall(r'extern "C" __global__ void (\w+)\(([^)]*)\)', code):
+    params += [x for x in re.findall(r'(\w+)\s*(?:,|$)', signature[1]) if x not in arg_names and x not in params]
+  allocations = dict()
+  for name, dtype, shape in re.findall(r'allocate\(([\w.]+)(?:: [^,]+)?, (\w+), \[([^\]]*)\]', lower_source):
+    allocations[name] = (dtype, int(np.product(eval('[%s]' % shape))))
+  buffers = []
+  for name in params:
+    assert name in allocations, "Invalid kernel code: intermediate buffer `%s` is not allocated in lower source." % name
+    buffers.append('%d/%s/%s' % (allocations[name][1], allocations[name][0], name))
+  return buffers
+
+def translate_code(code, config, intermediates=[]):
+  assert(len(code.split('extern "C"')) >= 2)
   global_arg_props = get_global_arg_props()
 
   def get_kernel_metadata():
@@ -90,6 +106,7 @@ def translate_code(code, config):
     device_code = os.environ.get('DEVICE_NAME', '')
     device_code = device_code if device_code else 'default'
     header_meta = '///' + ','.join(inp_args) + ':' + ','.join(outp_args) + '\n// BACKEND = %s (%s)\n' % (backend, device_code)
+    header_meta += ''.join(['// [intermediate] %s\n' % x for x in intermediates])
     properties = "// CONFIG: %s\n// COMPUTE_V1: %s\n" % (config.strip() if isinstance(config, str) else '', os.environ['COMPUTE_V1'])
     return header_meta + properties
 
@@ -118,6 +135,17 @@ def device_properties():
     mem_bandwith = 'inf' if not mem_bandwith else np.product(mem_bandwith) * 2.5e-7
     props.mem_bandwith = float(mem_bandwith)
 
+  # measured roofline of this host (engine/cpu_calibrate.cc) takes over the nominal bandwidth
+  props.peak_gflops = float('inf')
+  roofline_cfg = '%s/roofline.cfg' % os.environ['ANTARES_DRIVER_PATH']
+  if os.path.exists(roofline_cfg):
+    with open(roofline_cfg, 'r') as fp:
+      roofline = dict([line.split(': ') for line in fp.read().splitlines() if ': ' in line])
+    if float(roofline.get('StreamTriadMBps', 0)) > 0:
+      props.mem_bandwith = float(roofline['StreamTriadMBps']) * 1e-3
+    if float(roofline.get('PeakMflops', 0)) > 0:
+      props.peak_gflops = float(roofline['PeakMflops']) * 1e-3
+
   AntaresGlobal.device_props = props
   return props
 
@@ -202,39 +230,20 @@ def get_target_source(best_config, dir_sid=None):
       with open(lower_file, 'w') as fp:
         fp.write(lower_source)
 
-      # Verify Lower Code Code
-      if len(('\n' + lower_source).split('\nprimfn(')) != 2:
-        raise Exception('[Not Support Multi Unfuse-able kernels]\n\n' + lower_source)
-
       max_threads_per_block = device_properties().max_threads_per_block
       max_shared_memory_per_block = device_properties().max_shared_memory_per_block
       assert max_threads_per_block > 0 and max_shared_memory_per_block >= 0, '[Error] Invalid device properties, maybe device is not detected correctly.'
 
       lower_lines = lower_source.split('\n')
-      thread_extents, allocate_shared = [], []
+      allocate_shared = []
       for ll in lower_lines:
-        if ll.strip().startswith('attr [IterVar(') and ll.find(' "thread_extent" = ') >= 0:
-          thread_name = ll.split('attr [IterVar(')[-1].split(':')[0]
-          thread_val = int(ll.split(' "thread_extent" = ')[-1].split(';')[0].strip().split(' ')[0])
-          thread_extents.append((thread_name, thread_val))
-        elif ll.strip().startswith('allocate(') and ll.find('.shared, ') >= 0 and ll.endswith(");"):
+        if ll.strip().startswith('allocate(') and ll.find('.shared, ') >= 0 and ll.endswith(");"):
           parts = ll[:-2].split(', ')[1:]
           allocate_type = parts[0]
           allocate_val = int(np.product(eval(parts[1])))
           allocate_shared.append((allocate_type, allocate_val))
 
-      reserved_axes = dict()
-      for thread_name, thread_val in thread_extents:
-        if thread_name in reserved_axes:
-          assert reserved_axes[thread_name] == thread_val, "Invalid code: Multiple hints for thread extent conflict with each other: %d v.s. %d" % (reserved_axes[thread_name], thread_val)
-        else:
-          reserved_axes[thread_name] = thread_val
-
-      num_threads = 1
-      for thread_name in ['threadIdx.x', 'threadIdx.y', 'threadIdx.z']:
-        num_threads *= reserved_axes.get(thread_name, 1)
-      assert num_threads <= max_threads_per_block, "Invalid kernel code: using num_threads(%d) > max_threads_per_block(%d)" % (num_threads, max_threads_per_block)
-
+      # shared memory of all kernels in the module is counted together, which is conservative
       shared_memory_in_bytes = 0
       for allocate_type, allocate_size in allocate_shared:
         if allocate_type.startswith('custom['):
@@ -252,7 +261,28 @@ def get_target_source(best_config, dir_sid=None):
       func = build_template()
 
   assert(len(func.imported_modules) == 1)
-  device_source = translate_code(func.imported_modules[0].get_source(), best_config)
+  kernel_source = func.imported_modules[0].get_source()
+
+  # Stages that cannot fuse lower to a sequence of kernels, which the evaluator launches in order
+  kernels = kernel_source.split('extern "C" __global__ ')[1:]
+  if len(kernels) > 1 and backend not in ['c-cuda', 'c-rocm']:
+    raise Exception('[Not Support Multi Unfuse-able kernels on %s]\n\n' % backend + lower_source)
+  for kernel in kernels:
+    reserved_axes = dict()
+    for thread_name, thread_val in re.findall(r'// \[thread_extent\] (\w+\.\w+) = (\d+)', kernel):
+      thread_val = int(thread_val)
+      if thread_name in reserved_axes:
+        assert reserved_axes[thread_name] == thread_val, "Invalid code: Multiple hints for thread extent conflict with each other: %d v.s. %d" % (reserved_axes[thread_name], thread_val)
+      else:
+        reserved_axes[thread_name] = thread_val
+
+    num_threads = 1
+    for thread_name in ['threadIdx.x', 'threadIdx.y', 'threadIdx.z']:
+      num_threads *= reserved_axes.get(thread_name, 1)
+    assert num_threads <= max_threads_per_block, "Invalid kernel code: using num_threads(%d) > max_threads_per_block(%d)" % (num_threads, max_threads_per_block)
+
+  intermediates = get_intermediate_buffers(kernel_source, lower_source) if len(kernels) > 1 else []
+  device_source = translate_code(kernel_source, best_config, intermediates)
   kernel_path = local_get_dir_file('my_kernel.cc', dir_sid=dir_sid)
   with open(kernel_path, 'w') as fp:
     fp.write(device_source)
@@ -313,6 +343,11 @@ def evaluate_perf(kernel_path, dev_id, device_source, dir_sid=None, verbose=True
                   expected_timeout=expected_timeout,
                   dev_id=dev_id,
                 )
+      # EVAL_RANK=median (or min, p95, ..) ranks on that statistic of the samples, when the evaluator reports it
+      rank_key = 'TPR_' + os.environ.get('EVAL_RANK', '').upper()
+      if rank_key in results:
+        results.setdefault('TPR_MEAN', results['TPR'])
+        results['TPR'] = results[rank_key]
       return results
     except SystemExit:
       return None
@@ -331,25 +366,52 @@ def evaluate_perf(kernel_path, dev_id, device_source, dir_sid=None, verbose=True
   exec_fd()
   return results
 
-def compute_mem_ratio(tpr):
-  if math.isinf(tpr) or math.isinf(float(device_properties().mem_bandwith)):
-    return -1
-
+def get_access_bytes():
   global_arg_props = get_global_arg_props()
   access_bytes = 0
   for buf in global_arg_props['_in']:
     access_bytes += np.product(buf['shape']) * get_type_size(buf['dtype'])
   for buf in global_arg_props['_out']:
     access_bytes += np.product(buf['shape']) * get_type_size(buf['dtype'])
+  return int(access_bytes)
+
+def compute_mem_ratio(tpr):
+  if math.isinf(tpr) or math.isinf(float(device_properties().mem_bandwith)):
+    return -1
 
-  access_bytes = int(access_bytes)
+  access_bytes = get_access_bytes()
   if access_bytes <= 0:
     return -1
   ratio = np.ceil(access_bytes * 1e-7 / tpr / device_properties().mem_bandwith)
   return min(int(ratio), 100)
 
+def compute_roofline_ratio(tpr):
+  # attainable Gflops = min(peak Gflops, flop per compulsory byte * sustained bandwidth)
+  props = device_properties()
+  if math.isinf(tpr) or math.isinf(props.peak_gflops) or math.isinf(props.mem_bandwith):
+    return -1
+
+  access_bytes, flop = get_access_bytes(), AntaresGlobal.default_task.flop
+  if access_bytes <= 0 or flop <= 0:
+    return -1
+  roofline = min(props.peak_gflops, flop / access_bytes * props.mem_bandwith)
+  ratio = np.ceil(compute_gflops(flop, tpr) * 100 / roofline)
+  return min(int(ratio), 100)
+
+def compute_counter_ratios(results):
+  # only backends reporting hardware counters (e.g. c-mcpu with CPU_COUNTERS=1) produce these
+  if not results or 'IPC' not in results:
+    return ''
+  ratios = ', ipc = %.2f' % float(results['IPC'])
+  flop = float(results.get('FP_OPS', AntaresGlobal.default_task.flop))
+  if 'LLC_MISSES' in results and flop > 0:
+    # every last level cache miss moves one 64-byte line from memory
+    ratios += ', bytes_per_flop = %.3f' % (float(results['LLC_MISSES']) * 64 / flop)
+  return ratios
+
 def run_config_entity(target_source, config_str, dir_sid, expected_timecost='inf', dev_id=0):
   print("  >> [ ] Param_entity on sid = %s: config = '%s', dev_id = %d, upper_bound_tpr = %.6e s" % (dir_sid, config_str, dev_id, expected_timecost))
+  results = None
   try:
     assert target_source is not None, "Invalid target source detected in verification stage."
     device_source, kernel_path, compile_args = target_source
@@ -357,12 +419,15 @@ def run_config_entity(target_source, config_str, dir_sid, expected_timecost='inf
     do_compilation(compile_args, verbose=False)
     results = evaluate_perf(kernel_path, dev_id, device_source, dir_sid, verbose=False)
     assert results is not None and 'TPR' in results, "Invalid target output detected in evaluation stage."
-    digest = ','.join(['%.6e' % float(results['K/%d' % i]) for i in range(len(results) - 1)])
+    digest = ','.join(['%.6e' % float(results['K/%d' % i]) for i in range(len(results)) if 'K/%d' % i in results])
     result = float(results['TPR'])
   except:
     digest = 'null'
     result = float('inf')
-  print("  >> [*] Param_entity on sid = %s: config = '%s', tpr = `%.6f`, digest = `%s`, mem_occupy = %d %%" % (dir_sid, config_str, result, digest, compute_mem_ratio(result)))
+  # no roofline without a calibrated peak (roofline.cfg, c-mcpu only) or without a result
+  roofline = compute_roofline_ratio(result)
+  roofline = ', roofline = %d %%' % roofline if roofline >= 0 else ''
+  print("  >> [*] Param_entity on sid = %s: config = '%s', tpr = `%.6f`, digest = `%s`, mem_occupy = %d %%%s%s" % (dir_sid, config_str, result, digest, compute_mem_ratio(result), roofline, compute_counter_ratios(results)))
   return result
 
 
@@ -496,12 +561,13 @@ def main_compute(code_only=False):
           results.append(autotvm.measure.MeasureResult(costs=(t,), error_no=0, all_cost=i, timestamp=time.time()))
         AntaresGlobal.current_step += len(results)
 
-        print('\nSTEP[%d / %d] Current Best Config = %s, Perf = %g Gflops, MemRatio = %g %%, Occur Step = %d;' % (
+        print('\nSTEP[%d / %d] Current Best Config = %s, Perf = %g Gflops, MemRatio = %g %%, Roofline = %g %%, Occur Step = %d;' % (
           AntaresGlobal.current_step,
           num_trials,
           json.dumps(config_to_json(tuner.task.best.config)),
           compute_gflops(tuner.task.flop, tuner.task.best.timecost),
           compute_mem_ratio(tuner.task.best.timecost),
+          compute_roofline_ratio(tuner.task.best.timecost),
           tuner.task.best.occur))
 
         if auto_commit and best_slot >= 0:
@@ -37,12 +37,29 @@ if [[ "$BACKEND" == "c-rocm" ]]; then
   /opt/rocm/bin/hipcc engine/cuda_properties.cc -o ${ANTARES_DRIVER_PATH}/device_properties >/dev/null 2>&1 || true
   ${ANTARES_DRIVER_PATH}/device_properties > ${ANTARES_DRIVER_PATH}/device_properties.cfg 2>/dev/null || rm -f ${ANTARES_DRIVER_PATH}/device_properties.cfg
 elif [[ "$BACKEND" == "c-cuda" ]]; then
-  g++ engine/cuda_properties.cc -lcuda -I/usr/local/cuda/include -L/usr/local/cuda/lib64 -o ${ANTARES_DRIVER_PATH}/device_properties >/dev/null 2>&1 || true
+  g++ engine/cuda_properties.cc -lcuda -I${CUDA_HOME:-/usr/local/cuda}/include -L${CUDA_HOME:-/usr/local/cuda}/lib64 -Wl,-rpath,${CUDA_HOME:-/usr/local/cuda}/lib64 -o ${ANTARES_DRIVER_PATH}/device_properties >/dev/null 2>&1 || true
+  ${ANTARES_DRIVER_PATH}/device_properties > ${ANTARES_DRIVER_PATH}/device_properties.cfg 2>/dev/null || rm -f ${ANTARES_DRIVER_PATH}/device_properties.cfg
+elif [[ "$BACKEND" == "c-mcpu" ]] && [[ "${HARDWARE_CONFIG}" == "" ]]; then
+  g++ engine/cpu_properties.cc -std=c++11 -O2 -march=native -lpthread -o ${ANTARES_DRIVER_PATH}/device_properties >/dev/null 2>&1 || true
   ${ANTARES_DRIVER_PATH}/device_properties > ${ANTARES_DRIVER_PATH}/device_properties.cfg 2>/dev/null || rm -f ${ANTARES_DRIVER_PATH}/device_properties.cfg
 else
   rm -f ${ANTARES_DRIVER_PATH}/device_properties.cfg
 fi
 
+# Roofline calibration takes seconds, so it is measured once per host (and CPU count) and cached
+if [[ "$BACKEND" == "c-mcpu" ]] && [[ "${HARDWARE_CONFIG}" == "" ]]; then
+  ROOFLINE_CACHE=${ANTARES_CALIBRATION_PATH:-${HOME}/.cache/antares}/roofline-$(hostname)-$(nproc).cfg
+  if [ ! -e ${ROOFLINE_CACHE} ]; then
+    echo "  >> Calibrating ${BACKEND} roofline of this host .."
+    mkdir -p $(dirname ${ROOFLINE_CACHE})
+    g++ engine/cpu_calibrate.cc -std=c++11 -O2 -march=native -lpthread -o ${ANTARES_DRIVER_PATH}/calibrate >/dev/null 2>&1 && \
+      ${ANTARES_DRIVER_PATH}/calibrate > ${ROOFLINE_CACHE}.tmp 2>/dev/null && mv ${ROOFLINE_CACHE}.tmp ${ROOFLINE_CACHE} || rm -f ${ROOFLINE_CACHE}.tmp
+  fi
+  cp ${ROOFLINE_CACHE} ${ANTARES_DRIVER_PATH}/roofline.cfg 2>/dev/null || rm -f ${ANTARES_DRIVER_PATH}/roofline.cfg
+else
+  rm -f ${ANTARES_DRIVER_PATH}/roofline.cfg
+fi
+
 if [ ! -e ${ANTARES_DRIVER_PATH}/device_properties.cfg ]; then
   if [[ "${HARDWARE_CONFIG}" != "" ]]; then
     cat hardware/${HARDWARE_CONFIG}.cfg > ${ANTARES_DRIVER_PATH}/device_properties.cfg
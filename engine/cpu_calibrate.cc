@@ -0,0 +1,228 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Roofline calibration of the host CPU for the c-mcpu backend, printed as
+// `key: value` lines like cpu_properties.cc (bandwidths in MB/s, throughputs
+// in Mflops):
+//   Stream{Copy,Scale,Triad}MBps         all allowed CPUs, pages spread by first touch
+//   Node<n>Stream{Copy,Scale,Triad}MBps  CPUs of NUMA node n on memory of node n
+//   PeakMflops{Scalar,SSE,AVX2,AVX512}   fp32 FMA on all allowed CPUs, per ISA built in
+//   PeakMflops                           best of the ISAs above
+// Bandwidths count bytes the way STREAM does: 2 x 8 per element for copy and
+// scale, 3 x 8 for triad. Build with -march=native so that every vector ISA of
+// the host is measured.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEEP_IN_REGISTER(x) asm volatile("" : "+v"(x))
+#elif defined(__aarch64__)
+#define KEEP_IN_REGISTER(x) asm volatile("" : "+w"(x))
+#else
+#define KEEP_IN_REGISTER(x) asm volatile("" : "+r"(x))
+#endif
+
+#define P(key, value) printf("%s: %lld\n", std::string(key).c_str(), (long long)(value))
+
+// independent FMA dependency chains per thread, enough to cover latency x ports
+#define FMA_CHAINS 12
+
+static long long last_level_cache_size() {
+	long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (size <= 0)
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	return size > 0 ? size : 0;
+}
+
+// allowed CPUs grouped by their NUMA node, node 0 only without sysfs
+static std::map<int, std::vector<int>> node_cpus() {
+	std::map<int, std::vector<int>> nodes;
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return nodes;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		int node = 0;
+		std::string root = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+		if (DIR *dir = opendir(root.c_str())) {
+			while (struct dirent *entry = readdir(dir))
+				if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+					node = atoi(entry->d_name + 4);
+					break;
+				}
+			closedir(dir);
+		}
+		nodes[node].push_back(cpu);
+	}
+	return nodes;
+}
+
+struct spin_barrier {
+	std::atomic<int> arrived, phase;
+	int size;
+
+	spin_barrier(int size): arrived(0), phase(0), size(size) {
+	}
+
+	void wait() {
+		int current = phase.load();
+		if (arrived.fetch_add(1) + 1 == size) {
+			arrived.store(0);
+			phase.fetch_add(1);
+		} else {
+			while (phase.load() == current)
+				std::this_thread::yield();
+		}
+	}
+};
+
+// Runs body(rank, barrier) on one thread per CPU of `cpus`, each pinned to its CPU.
+// Rank 0 times the section between two barrier waits, so all ranks start together.
+template <class F>
+static void run_pinned(const std::vector<int> &cpus, F body) {
+	spin_barrier barrier(cpus.size());
+	std::vector<std::thread> workers;
+	for (int rank = 0; rank < (int)cpus.size(); ++rank)
+		workers.emplace_back([&, rank]() {
+			cpu_set_t mask;
+			CPU_ZERO(&mask);
+			CPU_SET(cpus[rank], &mask);
+			sched_setaffinity(0, sizeof(mask), &mask);
+			body(rank, barrier);
+		});
+	for (auto &worker: workers)
+		worker.join();
+}
+
+static double seconds_since(const std::chrono::high_resolution_clock::time_point &t1) {
+	return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - t1).count();
+}
+
+// Best of a few copy (c = a), scale (b = s * c) and triad (a = b + s * c) sweeps
+// over `count` doubles per array. Each rank allocates and first touches its own
+// slice, so the pages of a rank live on the node of its CPU.
+static std::vector<double> stream_bandwidth_mbps(const std::vector<int> &cpus, size_t count) {
+	static const double bytes_per_element[3] = {16.0, 16.0, 24.0};
+	size_t slice = std::max<size_t>(count / cpus.size(), 1);
+	std::vector<double> best(3, 0.0);
+	std::chrono::high_resolution_clock::time_point t1;
+	run_pinned(cpus, [&](int rank, spin_barrier &barrier) {
+		double *a = (double *)malloc(3 * slice * sizeof(double)), *b = a + slice, *c = b + slice;
+		for (size_t i = 0; i < slice; ++i)
+			a[i] = 1.0, b[i] = 2.0, c[i] = 0.0;
+		for (int rep = 0; rep < 6; ++rep) {
+			for (int kernel = 0; kernel < 3; ++kernel) {
+				barrier.wait();
+				if (rank == 0)
+					t1 = std::chrono::high_resolution_clock::now();
+				if (kernel == 0) {
+					for (size_t i = 0; i < slice; ++i)
+						c[i] = a[i];
+				} else if (kernel == 1) {
+					for (size_t i = 0; i < slice; ++i)
+						b[i] = 3.0 * c[i];
+				} else {
+					for (size_t i = 0; i < slice; ++i)
+						a[i] = b[i] + 3.0 * c[i];
+				}
+				barrier.wait();
+				if (rank == 0)
+					best[kernel] = std::max(best[kernel], bytes_per_element[kernel] * slice * cpus.size() / seconds_since(t1) * 1e-6);
+			}
+		}
+		free(a);
+	});
+	return best;
+}
+
+// Best of a few runs of FMA_CHAINS independent chains acc = acc * x + y per rank,
+// `lanes` fp32 values per vector; x = y = 0.5 keeps every chain at normal numbers.
+template <class vec, class fma_op>
+static double peak_mflops(const std::vector<int> &cpus, int lanes, vec half, fma_op fma) {
+	const long long iters = 1LL << 22;
+	double best = 0.0;
+	std::chrono::high_resolution_clock::time_point t1;
+	run_pinned(cpus, [&](int rank, spin_barrier &barrier) {
+		vec acc[FMA_CHAINS];
+		for (int rep = 0; rep < 4; ++rep) {
+			for (int i = 0; i < FMA_CHAINS; ++i)
+				acc[i] = half;
+			barrier.wait();
+			if (rank == 0)
+				t1 = std::chrono::high_resolution_clock::now();
+			for (long long it = 0; it < iters; ++it) {
+				for (int i = 0; i < FMA_CHAINS; ++i) {
+					acc[i] = fma(acc[i], half, half);
+					KEEP_IN_REGISTER(acc[i]);
+				}
+			}
+			barrier.wait();
+			if (rank == 0)
+				best = std::max(best, 2.0 * lanes * FMA_CHAINS * iters * cpus.size() / seconds_since(t1) * 1e-6);
+		}
+		volatile vec sink = acc[0];
+		(void)sink;
+	});
+	return best;
+}
+
+int main() {
+	auto nodes = node_cpus();
+	if (nodes.empty())
+		return 1;
+	std::vector<int> all_cpus;
+	for (auto &it: nodes)
+		all_cpus.insert(all_cpus.end(), it.second.begin(), it.second.end());
+
+	// arrays well beyond the last level cache of one package, capped to keep calibration short
+	size_t count = std::min(std::max<long long>(last_level_cache_size() * 4, 64LL << 20), 256LL << 20) / sizeof(double);
+	auto stream = stream_bandwidth_mbps(all_cpus, count * nodes.size());
+	P("StreamCopyMBps", stream[0]);
+	P("StreamScaleMBps", stream[1]);
+	P("StreamTriadMBps", stream[2]);
+	for (auto &it: nodes) {
+		auto node_stream = stream_bandwidth_mbps(it.second, count);
+		std::string node = "Node" + std::to_string(it.first);
+		P(node + "StreamCopyMBps", node_stream[0]);
+		P(node + "StreamScaleMBps", node_stream[1]);
+		P(node + "StreamTriadMBps", node_stream[2]);
+	}
+
+	double peak = peak_mflops(all_cpus, 1, 0.5f, [](float a, float b, float c) {
+#if defined(__FMA__)
+		return __builtin_fmaf(a, b, c);
+#else
+		return a * b + c;
+#endif
+	});
+	P("PeakMflopsScalar", peak);
+#if defined(__FMA__)
+	double sse = peak_mflops(all_cpus, 4, _mm_set1_ps(0.5f), [](__m128 a, __m128 b, __m128 c) { return _mm_fmadd_ps(a, b, c); });
+	double avx2 = peak_mflops(all_cpus, 8, _mm256_set1_ps(0.5f), [](__m256 a, __m256 b, __m256 c) { return _mm256_fmadd_ps(a, b, c); });
+	P("PeakMflopsSSE", sse);
+	P("PeakMflopsAVX2", avx2);
+	peak = std::max(peak, std::max(sse, avx2));
+#endif
+#if defined(__AVX512F__)
+	double avx512 = peak_mflops(all_cpus, 16, _mm512_set1_ps(0.5f), [](__m512 a, __m512 b, __m512 c) { return _mm512_fmadd_ps(a, b, c); });
+	P("PeakMflopsAVX512", avx512);
+	peak = std::max(peak, avx512);
+#endif
+	P("PeakMflops", peak);
+	return 0;
+}
@@ -0,0 +1,174 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Device properties of the host CPU for the c-mcpu backend, printed in the
+// format of cuda_properties.cc so that device_properties.cfg stays readable by
+// the TVM device stub. CUDA keys are mapped onto their nearest CPU meaning:
+// MultiProcessorCount is the number of physical cores, ClockRate the maximum
+// core clock in kHz, and GlobalMemoryBusWidth * MemoryClockRate encodes the
+// measured memory bandwidth (64-bit bus, so MemoryClockRate = GB/s * 62500).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define P(key, value) printf("%s: %lld\n", key, (long long)(value))
+
+static long long read_value(const std::string &path, long long def_val) {
+	std::ifstream fp(path);
+	long long value;
+	return (fp >> value) ? value : def_val;
+}
+
+// cache size of one level, in bytes, from sysconf or sysfs
+static long long cache_size(int level) {
+	static const int names[] = {0, _SC_LEVEL1_DCACHE_SIZE, _SC_LEVEL2_CACHE_SIZE, _SC_LEVEL3_CACHE_SIZE};
+	long size = sysconf(names[level]);
+	if (size > 0)
+		return size;
+	for (int index = 0; index < 8; ++index) {
+		std::string root = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index);
+		std::ifstream type_fp(root + "/type"), size_fp(root + "/size");
+		std::string type, text;
+		if (read_value(root + "/level", 0) != level || !(type_fp >> type) || type == "Instruction" || !(size_fp >> text))
+			continue;
+		long long bytes = atoll(text.c_str());
+		return text.back() == 'K' ? bytes << 10 : text.back() == 'M' ? bytes << 20 : bytes;
+	}
+	return 0;
+}
+
+static std::set<std::string> cpu_flags() {
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	std::string line;
+	std::set<std::string> flags;
+	while (std::getline(cpuinfo, line)) {
+		if (line.compare(0, 5, "flags") != 0 && line.compare(0, 8, "Features") != 0)
+			continue;
+		char *state, *text = &line[line.find(':') + 1];
+		for (char *flag = strtok_r(text, " \t", &state); flag; flag = strtok_r(nullptr, " \t", &state))
+			flags.insert(flag);
+		break;
+	}
+	return flags;
+}
+
+// Best of a few triad sweeps (a = b + s * c, 3 x 8 bytes per element) over
+// arrays beyond the last level cache, one thread per allowed CPU.
+static double memory_bandwidth_gbps(int threads, long long llc_size) {
+	size_t count = std::min(std::max<long long>(llc_size * 4, 64LL << 20), 256LL << 20) / sizeof(double) / threads * threads;
+	std::vector<double> a(count), b(count, 1.0), c(count, 2.0);
+	size_t slice = count / threads;
+	auto sweep = [&](int rank) {
+		double *pa = a.data() + slice * rank, *pb = b.data() + slice * rank, *pc = c.data() + slice * rank;
+		for (size_t i = 0; i < slice; ++i)
+			pa[i] = pb[i] + 3.0 * pc[i];
+	};
+	double best = 0.0;
+	for (int rep = 0; rep < 6; ++rep) {
+		auto t1 = std::chrono::high_resolution_clock::now();
+		std::vector<std::thread> workers;
+		for (int rank = 1; rank < threads; ++rank)
+			workers.emplace_back(sweep, rank);
+		sweep(0);
+		for (auto &worker: workers)
+			worker.join();
+		double sec = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - t1).count();
+		// the first sweep also pays for page faults
+		if (rep > 0)
+			best = std::max(best, 3.0 * sizeof(double) * count / sec * 1e-9);
+	}
+	return best;
+}
+
+int main() {
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return 1;
+	std::set<std::pair<long long, long long>> cores;
+	std::set<long long> packages, nodes;
+	int logical = 0;
+	long long clock_khz = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		++logical;
+		std::string root = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+		long long package = read_value(root + "/topology/physical_package_id", 0);
+		cores.insert({package, read_value(root + "/topology/core_id", cpu)});
+		packages.insert(package);
+		clock_khz = std::max(clock_khz, read_value(root + "/cpufreq/cpuinfo_max_freq", 0));
+		if (DIR *dir = opendir(root.c_str())) {
+			while (struct dirent *entry = readdir(dir))
+				if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+					nodes.insert(atoll(entry->d_name + 4));
+			closedir(dir);
+		}
+	}
+	if (!clock_khz) {
+		std::ifstream cpuinfo("/proc/cpuinfo");
+		std::string line;
+		while (std::getline(cpuinfo, line))
+			if (line.compare(0, 7, "cpu MHz") == 0) {
+				clock_khz = (long long)(atof(line.substr(line.find(':') + 1).c_str()) * 1000);
+				break;
+			}
+	}
+
+	auto flags = cpu_flags();
+	auto has = [&](const char *flag) { return flags.count(flag) ? 1 : 0; };
+	int simd_width = has("avx512f") ? 512 : has("avx") ? 256 : (has("sse2") || has("asimd")) ? 128 : 0;
+	long long l3_size = cache_size(3), l2_size = cache_size(2);
+	double bandwidth = memory_bandwidth_gbps(logical, l3_size ? l3_size : l2_size);
+
+	// keys the TVM device stub expects; threadIdx.x of a c-mcpu kernel counts
+	// the ranks times the chunks claimed per rank, up to 32 (`cpu_chunks`)
+	int max_threads = std::max(logical * 32, 128);
+	P("MaxThreadsPerBlock", max_threads);
+	P("MaxBlockDimX", max_threads);
+	P("MaxBlockDimY", 1);
+	P("MaxBlockDimZ", 1);
+	P("MaxSharedMemoryPerBlock", 0);
+	P("WarpSize", 1);
+	P("ClockRate", clock_khz ? clock_khz : 1802000);
+	P("MultiProcessorCount", cores.size());
+	P("ComputeCapabilityMajor", 0);
+	P("ComputeCapabilityMinor", 0);
+	P("MaxRegistersPerBlock", 65536);
+	P("GlobalMemoryBusWidth", 64);
+	P("MemoryClockRate", bandwidth * 62500);
+
+	// CPU specific keys
+	P("PhysicalCores", cores.size());
+	P("LogicalCores", logical);
+	P("ThreadsPerCore", cores.empty() ? 1 : (logical + cores.size() - 1) / cores.size());
+	P("Packages", packages.size());
+	P("NumaNodes", std::max<size_t>(1, nodes.size()));
+	P("L1DataCacheSize", cache_size(1));
+	P("L2CacheSize", l2_size);
+	P("L3CacheSize", l3_size);
+	P("SimdWidth", simd_width);
+	P("MemoryBandwidthMBps", bandwidth * 1000);
+	P("HasFMA", has("fma"));
+	P("HasF16C", has("f16c"));
+	P("HasAVX2", has("avx2"));
+	P("HasAVX512F", has("avx512f"));
+	P("HasAVX512VNNI", has("avx512_vnni"));
+	P("HasAVXVNNI", has("avx_vnni"));
+	P("HasAVX512BF16", has("avx512_bf16"));
+	P("HasAVX512FP16", has("avx512_fp16"));
+	P("HasAMX", has("amx_tile"));
+	return 0;
+}
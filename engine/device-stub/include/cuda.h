@@ -5,15 +5,19 @@
 #define __ANTARES_CUDA_STUB__
 
 #include <assert.h>
+#include <stddef.h>
 
 typedef void* cudaEvent_t;
 typedef void* cudaStream_t;
 typedef void* CUfunction;
 typedef void* CUmodule;
 typedef void* CUstream;
+typedef void* CUevent;
+typedef void* CUcontext;
 typedef void* nvrtcProgram;
 
 typedef unsigned long long CUdeviceptr;
+typedef int CUdevice;
 typedef int cudaMemcpyKind;
 typedef int cudaError_t;
 typedef int CUresult;
@@ -22,9 +26,21 @@ typedef int cudaDeviceAttr;
 
 #define CUDA_VERSION 10000
 #define CUDA_SUCCESS 0
+#define CUDA_ERROR_INVALID_VALUE 1
+#define CUDA_ERROR_OUT_OF_MEMORY 2
+#define CUDA_ERROR_NOT_INITIALIZED 3
 #define CUDA_ERROR_DEINITIALIZED 4
+#define CUDA_ERROR_INVALID_IMAGE 200
+#define CUDA_ERROR_INVALID_HANDLE 400
+#define CUDA_ERROR_NOT_FOUND 500
+#define CUDA_ERROR_NOT_READY 600
+#define CUDA_ERROR_LAUNCH_FAILED 719
+#define CUDA_ERROR_NOT_SUPPORTED 801
 #define cudaSuccess 0
+#define cudaErrorInvalidValue 1
+#define cudaErrorMemoryAllocation 2
 #define cudaErrorCudartUnloading 29
+#define cudaErrorNotReady 600
 #define cudaMemcpyHostToDevice 1
 #define cudaMemcpyDeviceToHost 2
 #define cudaMemcpyDeviceToDevice 3
@@ -41,35 +57,119 @@ typedef int cudaDeviceAttr;
 #define cudaDevAttrMaxBlockDimY 3
 #define cudaDevAttrMaxBlockDimZ 4
 #define cudaDevAttrMaxRegistersPerBlock 12
+#define cudaDevAttrMemoryClockRate 36
+#define cudaDevAttrGlobalMemoryBusWidth 37
+#define cudaDevAttrL2CacheSize 38
 
-#define _STUB(x)  static int x(...) { assert(#x == NULL); }
+typedef enum CUdevice_attribute_enum {
+    CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK = 1,
+    CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_X = 2,
+    CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Y = 3,
+    CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Z = 4,
+    CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK = 8,
+    CU_DEVICE_ATTRIBUTE_WARP_SIZE = 10,
+    CU_DEVICE_ATTRIBUTE_MAX_REGISTERS_PER_BLOCK = 12,
+    CU_DEVICE_ATTRIBUTE_CLOCK_RATE = 13,
+    CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT = 16,
+    CU_DEVICE_ATTRIBUTE_MEMORY_CLOCK_RATE = 36,
+    CU_DEVICE_ATTRIBUTE_GLOBAL_MEMORY_BUS_WIDTH = 37,
+    CU_DEVICE_ATTRIBUTE_L2_CACHE_SIZE = 38,
+    CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR = 75,
+    CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR = 76,
+} CUdevice_attribute;
+
+// The functions below are implemented by the host emulation in
+// src/cuda_emulator.cc (built as lib64/libcudart.so, libcuda.so links to it):
+// device memory is host memory, every stream is a worker thread that runs its
+// work in order, events carry wall clock timestamps, and a module is a shared
+// object built by bin/nvcc, which translates CUDA kernels into host code.
+
+struct dim3 {
+    unsigned int x, y, z;
+    dim3(unsigned int x = 1, unsigned int y = 1, unsigned int z = 1) : x(x), y(y), z(z) {}
+};
+
+// Every kernel NAME of an emulated module is exported as a descriptor of this
+// type. `entry` runs one CUDA thread; kernels that are `cooperative` (shared
+// memory, barriers or warp shuffles) run one block at a time with a host
+// thread per CUDA thread, the others run all CUDA threads in parallel loops.
+struct cuda_emulated_kernel {
+    void (*entry)(void **args, const dim3 &gridDim, const dim3 &blockDim, const dim3 &blockIdx, const dim3 &threadIdx);
+    int cooperative;
+    int num_params;
+    const unsigned int *param_sizes;
+};
+
+extern "C" {
+
+CUresult cuInit(unsigned int flags);
+CUresult cuDeviceGet(CUdevice *device, int ordinal);
+CUresult cuDeviceGetCount(int *count);
+CUresult cuDeviceGetName(char *name, int len, CUdevice dev);
+CUresult cuDeviceGetAttribute(int *value, CUdevice_attribute attrib, CUdevice dev);
+CUresult cuDevicePrimaryCtxRetain(CUcontext *pctx, CUdevice dev);
+CUresult cuCtxSetCurrent(CUcontext ctx);
+CUresult cuCtxSynchronize(void);
+CUresult cuGetErrorName(CUresult error, const char **pstr);
 
-_STUB(cudaGetErrorString)
-_STUB(cudaSetDevice)
-_STUB(cudaGetDevice)
-_STUB(cudaDeviceGetAttribute)
-_STUB(cuDeviceGetName)
-_STUB(cuGetErrorName)
-_STUB(cuModuleGetGlobal)
-_STUB(cuModuleLoadData)
-_STUB(cuModuleUnload)
-_STUB(cuModuleGetFunction)
-_STUB(cudaMalloc)
-_STUB(cudaFree)
-_STUB(cudaMallocHost)
-_STUB(cudaFreeHost)
-_STUB(cudaMemcpyPeerAsync)
-_STUB(cudaMemcpyAsync)
-_STUB(cudaMemcpy)
-_STUB(cudaStreamCreate)
-_STUB(cudaStreamDestroy)
-_STUB(cudaStreamWaitEvent)
-_STUB(cudaStreamSynchronize)
-_STUB(cudaEventCreate)
-_STUB(cudaEventRecord)
-_STUB(cudaEventDestroy)
-_STUB(cuLaunchKernel)
-_STUB(cuMemsetD32)
+CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize);
+CUresult cuMemFree(CUdeviceptr dptr);
+CUresult cuMemAllocHost(void **pp, size_t bytesize);
+CUresult cuMemFreeHost(void *p);
+CUresult cuMemcpyHtoD(CUdeviceptr dst, const void *src, size_t bytesize);
+CUresult cuMemcpyDtoH(void *dst, CUdeviceptr src, size_t bytesize);
+CUresult cuMemcpyDtoD(CUdeviceptr dst, CUdeviceptr src, size_t bytesize);
+CUresult cuMemcpyHtoDAsync(CUdeviceptr dst, const void *src, size_t bytesize, CUstream stream);
+CUresult cuMemcpyDtoHAsync(void *dst, CUdeviceptr src, size_t bytesize, CUstream stream);
+CUresult cuMemcpyDtoDAsync(CUdeviceptr dst, CUdeviceptr src, size_t bytesize, CUstream stream);
+CUresult cuMemsetD32(CUdeviceptr dst, unsigned int value, size_t count);
+CUresult cuMemsetD32Async(CUdeviceptr dst, unsigned int value, size_t count, CUstream stream);
+
+CUresult cuModuleLoad(CUmodule *module, const char *fname);
+CUresult cuModuleLoadData(CUmodule *module, const void *image);
+CUresult cuModuleUnload(CUmodule module);
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule module, const char *name);
+CUresult cuModuleGetGlobal(CUdeviceptr *dptr, size_t *bytes, CUmodule module, const char *name);
+CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+    unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+    unsigned int sharedMemBytes, CUstream stream, void **kernelParams, void **extra);
+
+CUresult cuStreamCreate(CUstream *stream, unsigned int flags);
+CUresult cuStreamDestroy(CUstream stream);
+CUresult cuStreamSynchronize(CUstream stream);
+CUresult cuStreamWaitEvent(CUstream stream, CUevent event, unsigned int flags);
+CUresult cuEventCreate(CUevent *event, unsigned int flags);
+CUresult cuEventRecord(CUevent event, CUstream stream);
+CUresult cuEventQuery(CUevent event);
+CUresult cuEventSynchronize(CUevent event);
+CUresult cuEventElapsedTime(float *ms, CUevent start, CUevent end);
+CUresult cuEventDestroy(CUevent event);
+
+const char *cudaGetErrorString(cudaError_t error);
+cudaError_t cudaSetDevice(int device);
+cudaError_t cudaGetDevice(int *device);
+cudaError_t cudaDeviceGetAttribute(int *value, cudaDeviceAttr attr, int device);
+cudaError_t cudaDeviceSynchronize(void);
+cudaError_t cudaMalloc(void **ptr, size_t size);
+cudaError_t cudaFree(void *ptr);
+cudaError_t cudaMallocHost(void **ptr, size_t size);
+cudaError_t cudaFreeHost(void *ptr);
+cudaError_t cudaMemcpy(void *dst, const void *src, size_t count, cudaMemcpyKind kind);
+cudaError_t cudaMemcpyAsync(void *dst, const void *src, size_t count, cudaMemcpyKind kind, cudaStream_t stream = 0);
+cudaError_t cudaMemcpyPeerAsync(void *dst, int dst_device, const void *src, int src_device, size_t count, cudaStream_t stream = 0);
+cudaError_t cudaStreamCreate(cudaStream_t *stream);
+cudaError_t cudaStreamDestroy(cudaStream_t stream);
+cudaError_t cudaStreamWaitEvent(cudaStream_t stream, cudaEvent_t event, unsigned int flags);
+cudaError_t cudaStreamSynchronize(cudaStream_t stream);
+cudaError_t cudaEventCreate(cudaEvent_t *event);
+cudaError_t cudaEventRecord(cudaEvent_t event, cudaStream_t stream = 0);
+cudaError_t cudaEventSynchronize(cudaEvent_t event);
+cudaError_t cudaEventElapsedTime(float *ms, cudaEvent_t start, cudaEvent_t end);
+cudaError_t cudaEventDestroy(cudaEvent_t event);
+
+}
+
+#define _STUB(x)  static int x(...) { assert(#x == NULL); }
 
 _STUB(nvrtcCreateProgram)
 _STUB(nvrtcGetErrorString)
@@ -0,0 +1,187 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef __ANTARES_CUDA_EMULATION__
+#define __ANTARES_CUDA_EMULATION__
+
+// Device side of the host CUDA emulation, included by every kernel that
+// bin/nvcc translates. The kernel body becomes a function of one CUDA thread
+// that receives gridDim, blockDim, blockIdx and threadIdx as arguments, so the
+// built-in names resolve as usual. __shared__ arrays become static, which is
+// safe since src/cuda_emulator.cc runs the blocks of a cooperative kernel one
+// after another; __syncthreads and warp shuffles synchronize all host threads
+// of the block, so every thread of the block has to reach them.
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include "cuda.h"
+
+using std::max;
+using std::min;
+
+#define __global__
+#define __device__
+#define __host__
+#define __forceinline__ inline
+#define __launch_bounds__(...)
+#define __align__(n) __attribute__((aligned(n)))
+#define warpSize 32
+
+extern "C" void __cuda_emulation_syncthreads(void);
+// 8 bytes for each thread of the current block, for warp shuffles
+extern "C" void *__cuda_emulation_exchange(void);
+
+#define __syncthreads() __cuda_emulation_syncthreads()
+// threads of a warp do not run in lockstep, code relying on that is not emulated
+#define __syncwarp(...)
+#define __threadfence_block() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __threadfence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __activemask() 0xffffffffu
+
+static inline int __cuda_emulation_width(int width = warpSize) {
+    return width;
+}
+
+template <class T> static inline T __cuda_emulation_shfl(T value, unsigned int src, bool valid, unsigned int tid) {
+    static_assert(sizeof(T) <= sizeof(uint64_t), "Warp shuffle of a type wider than 8 bytes.");
+    uint64_t *slots = (uint64_t *)__cuda_emulation_exchange();
+    memcpy(slots + tid, &value, sizeof(T));
+    __cuda_emulation_syncthreads();
+    T result = value;
+    if (valid)
+        memcpy(&result, slots + src, sizeof(T));
+    __cuda_emulation_syncthreads();
+    return result;
+}
+
+// lanes are numbered by the linear thread index, in segments of `width` lanes
+#define __cuda_emulation_tid (threadIdx.x + blockDim.x * (threadIdx.y + blockDim.y * threadIdx.z))
+#define __cuda_emulation_threads (blockDim.x * blockDim.y * blockDim.z)
+
+template <class T> static inline T __cuda_emulation_shfl_idx(T value, int lane, int width, unsigned int tid, unsigned int threads) {
+    unsigned int src = tid - tid % width + lane % width;
+    return __cuda_emulation_shfl(value, src, src < threads, tid);
+}
+
+template <class T> static inline T __cuda_emulation_shfl_down(T value, int delta, int width, unsigned int tid, unsigned int threads) {
+    unsigned int src = tid + delta;
+    return __cuda_emulation_shfl(value, src, src < std::min(tid - tid % width + width, threads), tid);
+}
+
+template <class T> static inline T __cuda_emulation_shfl_up(T value, int delta, int width, unsigned int tid, unsigned int threads) {
+    return __cuda_emulation_shfl(value, tid - delta, int(tid % width) >= delta, tid);
+}
+
+template <class T> static inline T __cuda_emulation_shfl_xor(T value, int lane_mask, int width, unsigned int tid, unsigned int threads) {
+    unsigned int src = tid - tid % width + ((tid % width) ^ lane_mask);
+    return __cuda_emulation_shfl(value, src, src < std::min(tid - tid % width + width, threads), tid);
+}
+
+#define __shfl_sync(mask, var, lane, ...) \
+    __cuda_emulation_shfl_idx(var, lane, __cuda_emulation_width(__VA_ARGS__), __cuda_emulation_tid, __cuda_emulation_threads)
+#define __shfl_down_sync(mask, var, delta, ...) \
+    __cuda_emulation_shfl_down(var, delta, __cuda_emulation_width(__VA_ARGS__), __cuda_emulation_tid, __cuda_emulation_threads)
+#define __shfl_up_sync(mask, var, delta, ...) \
+    __cuda_emulation_shfl_up(var, delta, __cuda_emulation_width(__VA_ARGS__), __cuda_emulation_tid, __cuda_emulation_threads)
+#define __shfl_xor_sync(mask, var, lane_mask, ...) \
+    __cuda_emulation_shfl_xor(var, lane_mask, __cuda_emulation_width(__VA_ARGS__), __cuda_emulation_tid, __cuda_emulation_threads)
+
+template <class T> static inline T atomicAdd(T *address, T value) {
+    return __atomic_fetch_add(address, value, __ATOMIC_SEQ_CST);
+}
+
+template <class T> static inline T __cuda_emulation_atomic_float_add(T *address, T value) {
+    T expected = *address, desired;
+    do {
+        desired = expected + value;
+    } while (!__atomic_compare_exchange(address, &expected, &desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    return expected;
+}
+
+static inline float atomicAdd(float *address, float value) {
+    return __cuda_emulation_atomic_float_add(address, value);
+}
+
+static inline double atomicAdd(double *address, double value) {
+    return __cuda_emulation_atomic_float_add(address, value);
+}
+
+// __expf, __logf and __powf are declared by glibc's math.h already
+static inline float __fdividef(float x, float y) { return x / y; }
+static inline float rsqrtf(float x) { return 1.0f / sqrtf(x); }
+static inline float __int_as_float(int x) { float y; memcpy(&y, &x, sizeof(y)); return y; }
+static inline int __float_as_int(float x) { int y; memcpy(&y, &x, sizeof(y)); return y; }
+
+// binary16 kept as bits, all arithmetic goes through float
+struct half {
+    uint16_t bits;
+
+    half() = default;
+    half(float f) {
+        uint32_t x, sign;
+        memcpy(&x, &f, sizeof(x));
+        sign = (x >> 16) & 0x8000, x &= 0x7fffffff;
+        if (x >= 0x7f800000) {
+            bits = sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+        } else if (x >= 0x477ff000) {
+            bits = sign | 0x7c00;
+        } else if (x < 0x38800000) {
+            // subnormal, let the FPU round it into the low mantissa bits of 0.5f
+            float a;
+            memcpy(&a, &x, sizeof(a));
+            a += 0.5f;
+            memcpy(&x, &a, sizeof(x));
+            bits = sign | (x - 0x3f000000);
+        } else {
+            bits = sign | ((x + 0xfff + ((x >> 13) & 1) - 0x38000000) >> 13);
+        }
+    }
+    operator float() const {
+        uint32_t sign = uint32_t(bits & 0x8000) << 16, exponent = (bits >> 10) & 0x1f, mantissa = bits & 0x3ff, x;
+        if (exponent == 0x1f) {
+            x = sign | 0x7f800000 | (mantissa << 13);
+        } else if (exponent) {
+            x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        } else {
+            float f = mantissa * 5.9604644775390625e-8f;
+            memcpy(&x, &f, sizeof(x));
+            x |= sign;
+        }
+        float f;
+        memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+    half &operator+=(float y) { return *this = half(float(*this) + y); }
+    half &operator-=(float y) { return *this = half(float(*this) - y); }
+    half &operator*=(float y) { return *this = half(float(*this) * y); }
+    half &operator/=(float y) { return *this = half(float(*this) / y); }
+};
+
+static inline half __float2half(float x) { return half(x); }
+static inline half __float2half_rn(float x) { return half(x); }
+static inline float __half2float(half x) { return float(x); }
+static inline half hexp(half x) { return half(expf(x)); }
+static inline half hlog(half x) { return half(logf(x)); }
+static inline half hsqrt(half x) { return half(sqrtf(x)); }
+
+#define __CUDA_EMULATION_VECTOR2(type, base) \
+    struct type { base x, y; }; \
+    static inline type make_##type(base x, base y) { type v = {x, y}; return v; }
+#define __CUDA_EMULATION_VECTOR4(type, base) \
+    struct type { base x, y, z, w; }; \
+    static inline type make_##type(base x, base y, base z, base w) { type v = {x, y, z, w}; return v; }
+
+__CUDA_EMULATION_VECTOR2(float2, float)
+__CUDA_EMULATION_VECTOR4(float4, float)
+__CUDA_EMULATION_VECTOR2(int2, int)
+__CUDA_EMULATION_VECTOR4(int4, int)
+__CUDA_EMULATION_VECTOR2(double2, double)
+__CUDA_EMULATION_VECTOR2(half2, half)
+__CUDA_EMULATION_VECTOR4(char4, signed char)
+__CUDA_EMULATION_VECTOR4(uchar4, unsigned char)
+
+typedef unsigned int uint;
+
+#endif
@@ -0,0 +1 @@
+cuda.h
\ No newline at end of file
@@ -0,0 +1,726 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Host emulation of the CUDA driver and runtime functions declared by
+// include/cuda.h, so that evaluators built against the device stub run
+// without a GPU. Build it as the stub's libcudart.so (libcuda.so links to it):
+//
+//   g++ src/cuda_emulator.cc -Iinclude -std=c++11 -O2 -shared -fPIC -lpthread -ldl -o lib64/libcudart.so
+//
+// Device memory is host memory. Every stream, and the null stream, is a
+// worker thread running its copies, launches and event records in order, so
+// that host code sees the usual asynchronous behaviour; an event stores the
+// wall clock time at which its stream reached it. A module is a shared object
+// built by bin/nvcc, which exports a cuda_emulated_kernel for every kernel.
+// Launches of all streams are serialized. A kernel is executed like the
+// c-mcpu backend does: a team of host threads stands in for the threads of a
+// block and loops over the blocks of the grid, with __syncthreads as barrier
+// of the team. Kernels without barriers instead split all their CUDA threads
+// over one host thread per CPU.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <elf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cuda.h"
+
+// Host threads of one launch: the stream worker that launches is rank 0, the
+// other ranks wait on a condition variable between runs.
+class thread_team {
+public:
+	explicit thread_team(int size): team_size(size), job(nullptr), generation(0), pending(0), stop(false), arrived(0), phase(0) {
+		for (int rank = 1; rank < team_size; ++rank)
+			workers.emplace_back([this, rank]() { worker_loop(rank); });
+	}
+
+	~thread_team() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		start_cv.notify_all();
+		for (auto &worker: workers)
+			worker.join();
+	}
+
+	int size() const {
+		return team_size;
+	}
+
+	// runs fn(rank) for every rank and waits for all of them
+	void run(const std::function<void(int)> &fn) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &fn;
+			pending = team_size - 1;
+			++generation;
+		}
+		start_cv.notify_all();
+		fn(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [this]() { return pending == 0; });
+	}
+
+	// all ranks of the current run meet here, threads may outnumber the CPUs by far
+	void barrier() {
+		uint64_t current = phase.load();
+		if (arrived.fetch_add(1) + 1 == team_size) {
+			arrived.store(0);
+			{
+				std::lock_guard<std::mutex> lock(barrier_mutex);
+				phase.fetch_add(1);
+			}
+			barrier_cv.notify_all();
+			return;
+		}
+		for (int spin = 0; spin < 64 && phase.load() == current; ++spin)
+			std::this_thread::yield();
+		std::unique_lock<std::mutex> lock(barrier_mutex);
+		barrier_cv.wait(lock, [&]() { return phase.load() != current; });
+	}
+
+private:
+	void worker_loop(int rank) {
+		uint64_t seen = 0;
+		for (;;) {
+			const std::function<void(int)> *fn;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_cv.wait(lock, [&]() { return stop || generation != seen; });
+				if (stop)
+					return;
+				seen = generation;
+				fn = job;
+			}
+			(*fn)(rank);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0)
+				done_cv.notify_one();
+		}
+	}
+
+	const int team_size;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start_cv, done_cv;
+	const std::function<void(int)> *job;
+	uint64_t generation;
+	int pending;
+	bool stop;
+
+	std::atomic<int> arrived;
+	std::atomic<uint64_t> phase;
+	std::mutex barrier_mutex;
+	std::condition_variable barrier_cv;
+};
+
+// A worker thread running the work of one stream in submission order.
+class stream_state {
+public:
+	stream_state(): busy(false), stop(false) {
+		worker = std::thread([this]() { worker_loop(); });
+	}
+
+	~stream_state() {
+		synchronize();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		work_cv.notify_one();
+		worker.join();
+	}
+
+	void enqueue(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		work_cv.notify_one();
+	}
+
+	void synchronize() {
+		std::unique_lock<std::mutex> lock(mutex);
+		idle_cv.wait(lock, [this]() { return tasks.empty() && !busy; });
+	}
+
+private:
+	void worker_loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			work_cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			std::function<void()> task = std::move(tasks.front());
+			tasks.pop_front();
+			busy = true;
+			lock.unlock();
+			task();
+			lock.lock();
+			busy = false;
+			if (tasks.empty())
+				idle_cv.notify_all();
+		}
+	}
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable work_cv, idle_cv;
+	std::deque<std::function<void()>> tasks;
+	bool busy, stop;
+};
+
+// Records are numbered: an event is complete once its stream has reached the
+// latest record, and waiting on it means waiting for the record issued so far.
+struct event_state {
+	std::mutex mutex;
+	std::condition_variable cv;
+	uint64_t recorded = 0, completed = 0;
+	std::chrono::steady_clock::time_point time;
+};
+
+struct module_state {
+	void *handle;
+};
+
+struct launch_params {
+	const cuda_emulated_kernel *kernel;
+	dim3 grid, block;
+	std::vector<char> storage;
+	std::vector<void *> args;
+};
+
+static std::mutex registry_mutex;
+static std::set<stream_state *> streams;
+
+static stream_state *get_stream(void *stream) {
+	static stream_state null_stream;
+	return stream ? (stream_state *)stream : &null_stream;
+}
+
+static int host_threads() {
+	int threads = std::thread::hardware_concurrency();
+	return threads > 0 ? threads : 1;
+}
+
+static std::mutex device_mutex;
+static std::unique_ptr<thread_team> flat_team, block_team;
+static std::vector<uint64_t> exchange_slots;
+
+extern "C" void __cuda_emulation_syncthreads(void) {
+	block_team->barrier();
+}
+
+extern "C" void *__cuda_emulation_exchange(void) {
+	return exchange_slots.data();
+}
+
+static void execute(const launch_params &launch) {
+	std::lock_guard<std::mutex> lock(device_mutex);
+	const cuda_emulated_kernel *kernel = launch.kernel;
+	void **args = (void **)launch.args.data();
+	const dim3 &grid = launch.grid, &block = launch.block;
+	size_t block_threads = size_t(block.x) * block.y * block.z, blocks = size_t(grid.x) * grid.y * grid.z;
+	auto index = [](size_t linear, const dim3 &dims) {
+		return dim3(linear % dims.x, linear / dims.x % dims.y, linear / dims.x / dims.y);
+	};
+
+	if (!kernel->cooperative) {
+		if (!flat_team)
+			flat_team.reset(new thread_team(host_threads()));
+		size_t total = blocks * block_threads, ranks = flat_team->size();
+		flat_team->run([&](int rank) {
+			for (size_t i = total * rank / ranks; i < total * (rank + 1) / ranks; ++i)
+				kernel->entry(args, grid, block, index(i / block_threads, grid), index(i % block_threads, block));
+		});
+		return;
+	}
+
+	if (!block_team || block_team->size() != int(block_threads)) {
+		block_team.reset();
+		block_team.reset(new thread_team(block_threads));
+	}
+	exchange_slots.resize(block_threads);
+	for (size_t b = 0; b < blocks; ++b) {
+		dim3 block_idx = index(b, grid);
+		block_team->run([&](int rank) {
+			kernel->entry(args, grid, block, block_idx, index(rank, block));
+		});
+	}
+}
+
+static const char *error_name(int error) {
+	switch (error) {
+	case CUDA_SUCCESS: return "CUDA_SUCCESS";
+	case CUDA_ERROR_INVALID_VALUE: return "CUDA_ERROR_INVALID_VALUE";
+	case CUDA_ERROR_OUT_OF_MEMORY: return "CUDA_ERROR_OUT_OF_MEMORY";
+	case CUDA_ERROR_NOT_INITIALIZED: return "CUDA_ERROR_NOT_INITIALIZED";
+	case CUDA_ERROR_DEINITIALIZED: return "CUDA_ERROR_DEINITIALIZED";
+	case CUDA_ERROR_INVALID_IMAGE: return "CUDA_ERROR_INVALID_IMAGE";
+	case CUDA_ERROR_INVALID_HANDLE: return "CUDA_ERROR_INVALID_HANDLE";
+	case CUDA_ERROR_NOT_FOUND: return "CUDA_ERROR_NOT_FOUND";
+	case CUDA_ERROR_NOT_READY: return "CUDA_ERROR_NOT_READY";
+	case CUDA_ERROR_LAUNCH_FAILED: return "CUDA_ERROR_LAUNCH_FAILED";
+	case CUDA_ERROR_NOT_SUPPORTED: return "CUDA_ERROR_NOT_SUPPORTED";
+	default: return "CUDA_ERROR_UNKNOWN";
+	}
+}
+
+static int device_attribute(int attr) {
+	switch (attr) {
+	case cudaDevAttrMaxThreadsPerBlock: return 1024;
+	case cudaDevAttrMaxBlockDimX: return 1024;
+	case cudaDevAttrMaxBlockDimY: return 1024;
+	case cudaDevAttrMaxBlockDimZ: return 64;
+	case cudaDevAttrMaxSharedMemoryPerBlock: return 48 << 10;
+	case cudaDevAttrWarpSize: return 32;
+	case cudaDevAttrMaxRegistersPerBlock: return 64 << 10;
+	case cudaDevAttrComputeCapabilityMajor: return 7;
+	case cudaDevAttrComputeCapabilityMinor: return 0;
+	case cudaDevAttrMultiProcessorCount: return host_threads();
+	case cudaDevAttrClockRate: {
+		std::ifstream fp("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
+		int khz;
+		return (fp >> khz) ? khz : 1000000;
+	}
+	// a nominal 10 GB/s on a 64-bit bus
+	case cudaDevAttrGlobalMemoryBusWidth: return 64;
+	case cudaDevAttrMemoryClockRate: return 10 * 62500;
+	// the last level cache of the host stands in for L2
+	case cudaDevAttrL2CacheSize: {
+		long bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+		if (bytes <= 0)
+			bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		return bytes > 0 ? int(bytes) : (8 << 20);
+	}
+	default: return -1;
+	}
+}
+
+static CUresult copy(void *dst, const void *src, size_t bytes, void *stream, bool sync) {
+	stream_state *target = get_stream(stream);
+	target->enqueue([=]() { memcpy(dst, src, bytes); });
+	if (sync)
+		target->synchronize();
+	return CUDA_SUCCESS;
+}
+
+static CUresult synchronize_all() {
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		for (auto it: streams)
+			it->synchronize();
+	}
+	get_stream(nullptr)->synchronize();
+	return CUDA_SUCCESS;
+}
+
+static CUresult load_module(CUmodule *module, const std::string &path) {
+	void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		fprintf(stderr, "[CUDA Emulator] %s\n", dlerror());
+		return CUDA_ERROR_INVALID_IMAGE;
+	}
+	*module = new module_state{handle};
+	return CUDA_SUCCESS;
+}
+
+extern "C" {
+
+CUresult cuInit(unsigned int) {
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGet(CUdevice *device, int ordinal) {
+	if (ordinal != 0)
+		return CUDA_ERROR_INVALID_VALUE;
+	*device = 0;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetCount(int *count) {
+	*count = 1;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetName(char *name, int len, CUdevice) {
+	snprintf(name, len, "Antares CUDA Emulator");
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetAttribute(int *value, CUdevice_attribute attrib, CUdevice) {
+	*value = device_attribute(attrib);
+	return *value >= 0 ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+CUresult cuDevicePrimaryCtxRetain(CUcontext *pctx, CUdevice) {
+	static int primary_context;
+	*pctx = &primary_context;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSetCurrent(CUcontext) {
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSynchronize(void) {
+	return synchronize_all();
+}
+
+CUresult cuGetErrorName(CUresult error, const char **pstr) {
+	*pstr = error_name(error);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize) {
+	void *ptr = nullptr;
+	if (posix_memalign(&ptr, 256, bytesize ? bytesize : 1) != 0)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	*dptr = (CUdeviceptr)ptr;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemFree(CUdeviceptr dptr) {
+	free((void *)dptr);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemAllocHost(void **pp, size_t bytesize) {
+	return cuMemAlloc((CUdeviceptr *)pp, bytesize);
+}
+
+CUresult cuMemFreeHost(void *p) {
+	free(p);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyHtoD(CUdeviceptr dst, const void *src, size_t bytesize) {
+	return copy((void *)dst, src, bytesize, nullptr, true);
+}
+
+CUresult cuMemcpyDtoH(void *dst, CUdeviceptr src, size_t bytesize) {
+	return copy(dst, (const void *)src, bytesize, nullptr, true);
+}
+
+CUresult cuMemcpyDtoD(CUdeviceptr dst, CUdeviceptr src, size_t bytesize) {
+	return copy((void *)dst, (const void *)src, bytesize, nullptr, true);
+}
+
+CUresult cuMemcpyHtoDAsync(CUdeviceptr dst, const void *src, size_t bytesize, CUstream stream) {
+	return copy((void *)dst, src, bytesize, stream, false);
+}
+
+CUresult cuMemcpyDtoHAsync(void *dst, CUdeviceptr src, size_t bytesize, CUstream stream) {
+	return copy(dst, (const void *)src, bytesize, stream, false);
+}
+
+CUresult cuMemcpyDtoDAsync(CUdeviceptr dst, CUdeviceptr src, size_t bytesize, CUstream stream) {
+	return copy((void *)dst, (const void *)src, bytesize, stream, false);
+}
+
+CUresult cuMemsetD32Async(CUdeviceptr dst, unsigned int value, size_t count, CUstream stream) {
+	get_stream(stream)->enqueue([=]() { std::fill((unsigned int *)dst, (unsigned int *)dst + count, value); });
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemsetD32(CUdeviceptr dst, unsigned int value, size_t count) {
+	cuMemsetD32Async(dst, value, count, nullptr);
+	get_stream(nullptr)->synchronize();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuModuleLoad(CUmodule *module, const char *fname) {
+	// a bare file name would make dlopen search the library path
+	std::string path = fname;
+	return load_module(module, path.find('/') == std::string::npos ? "./" + path : path);
+}
+
+CUresult cuModuleLoadData(CUmodule *module, const void *image) {
+	// the image is a whole shared object, whose section headers end the file
+	const Elf64_Ehdr *header = (const Elf64_Ehdr *)image;
+	if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64)
+		return CUDA_ERROR_INVALID_IMAGE;
+	size_t size = header->e_shoff + size_t(header->e_shnum) * header->e_shentsize;
+	char path[] = "/tmp/cuda_emulator_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return CUDA_ERROR_INVALID_IMAGE;
+	bool written = write(fd, image, size) == ssize_t(size);
+	close(fd);
+	CUresult result = written ? load_module(module, path) : CUDA_ERROR_INVALID_IMAGE;
+	unlink(path);
+	return result;
+}
+
+CUresult cuModuleUnload(CUmodule module) {
+	if (!module)
+		return CUDA_ERROR_INVALID_HANDLE;
+	// kernels of the module may still be queued
+	synchronize_all();
+	dlclose(((module_state *)module)->handle);
+	delete (module_state *)module;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule module, const char *name) {
+	if (!module)
+		return CUDA_ERROR_INVALID_HANDLE;
+	*hfunc = dlsym(((module_state *)module)->handle, name);
+	return *hfunc ? CUDA_SUCCESS : CUDA_ERROR_NOT_FOUND;
+}
+
+CUresult cuModuleGetGlobal(CUdeviceptr *dptr, size_t *bytes, CUmodule module, const char *name) {
+	if (!module)
+		return CUDA_ERROR_INVALID_HANDLE;
+	void *symbol = dlsym(((module_state *)module)->handle, name);
+	if (!symbol)
+		return CUDA_ERROR_NOT_FOUND;
+	if (dptr)
+		*dptr = (CUdeviceptr)symbol;
+	// symbol sizes are not kept by the dynamic linker
+	if (bytes)
+		*bytes = 0;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+		unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+		unsigned int sharedMemBytes, CUstream stream, void **kernelParams, void **extra) {
+	const cuda_emulated_kernel *kernel = (const cuda_emulated_kernel *)f;
+	if (!kernel)
+		return CUDA_ERROR_INVALID_HANDLE;
+	// dynamic shared memory and packed parameters are not emulated
+	if (sharedMemBytes || extra)
+		return CUDA_ERROR_NOT_SUPPORTED;
+	if (!gridDimX || !gridDimY || !gridDimZ || !blockDimX || !blockDimY || !blockDimZ
+			|| size_t(blockDimX) * blockDimY * blockDimZ > size_t(device_attribute(cudaDevAttrMaxThreadsPerBlock)))
+		return CUDA_ERROR_INVALID_VALUE;
+	if (kernel->num_params && !kernelParams)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	// parameters are copied at launch, as the caller may reuse its storage right away
+	auto launch = std::make_shared<launch_params>();
+	launch->kernel = kernel;
+	launch->grid = dim3(gridDimX, gridDimY, gridDimZ);
+	launch->block = dim3(blockDimX, blockDimY, blockDimZ);
+	size_t offset = 0;
+	std::vector<size_t> offsets;
+	for (int i = 0; i < kernel->num_params; ++i) {
+		offsets.push_back(offset);
+		offset += (kernel->param_sizes[i] + 15) & ~15u;
+	}
+	launch->storage.resize(offset);
+	for (int i = 0; i < kernel->num_params; ++i) {
+		memcpy(launch->storage.data() + offsets[i], kernelParams[i], kernel->param_sizes[i]);
+		launch->args.push_back(launch->storage.data() + offsets[i]);
+	}
+	get_stream(stream)->enqueue([launch]() { execute(*launch); });
+	return CUDA_SUCCESS;
+}
+
+CUresult cuStreamCreate(CUstream *stream, unsigned int) {
+	stream_state *state = new stream_state();
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	streams.insert(state);
+	*stream = state;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuStreamDestroy(CUstream stream) {
+	if (!stream)
+		return CUDA_ERROR_INVALID_HANDLE;
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		streams.erase((stream_state *)stream);
+	}
+	delete (stream_state *)stream;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuStreamSynchronize(CUstream stream) {
+	get_stream(stream)->synchronize();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuStreamWaitEvent(CUstream stream, CUevent event, unsigned int) {
+	event_state *state = (event_state *)event;
+	if (!state)
+		return CUDA_ERROR_INVALID_HANDLE;
+	uint64_t target;
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		target = state->recorded;
+	}
+	get_stream(stream)->enqueue([state, target]() {
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->cv.wait(lock, [&]() { return state->completed >= target; });
+	});
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventCreate(CUevent *event, unsigned int) {
+	*event = new event_state();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventRecord(CUevent event, CUstream stream) {
+	event_state *state = (event_state *)event;
+	if (!state)
+		return CUDA_ERROR_INVALID_HANDLE;
+	uint64_t record;
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		record = ++state->recorded;
+	}
+	get_stream(stream)->enqueue([state, record]() {
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->time = std::chrono::steady_clock::now();
+		state->completed = record;
+		state->cv.notify_all();
+	});
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventQuery(CUevent event) {
+	event_state *state = (event_state *)event;
+	if (!state)
+		return CUDA_ERROR_INVALID_HANDLE;
+	std::lock_guard<std::mutex> lock(state->mutex);
+	return state->completed == state->recorded ? CUDA_SUCCESS : CUDA_ERROR_NOT_READY;
+}
+
+CUresult cuEventSynchronize(CUevent event) {
+	event_state *state = (event_state *)event;
+	if (!state)
+		return CUDA_ERROR_INVALID_HANDLE;
+	std::unique_lock<std::mutex> lock(state->mutex);
+	uint64_t target = state->recorded;
+	state->cv.wait(lock, [&]() { return state->completed >= target; });
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventElapsedTime(float *ms, CUevent start, CUevent end) {
+	event_state *first = (event_state *)start, *last = (event_state *)end;
+	if (!first || !last)
+		return CUDA_ERROR_INVALID_HANDLE;
+	if (cuEventQuery(start) != CUDA_SUCCESS || cuEventQuery(end) != CUDA_SUCCESS)
+		return CUDA_ERROR_NOT_READY;
+	if (!first->recorded || !last->recorded)
+		return CUDA_ERROR_INVALID_HANDLE;
+	std::lock(first->mutex, last->mutex);
+	std::lock_guard<std::mutex> lock_first(first->mutex, std::adopt_lock), lock_last(last->mutex, std::adopt_lock);
+	*ms = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(last->time - first->time).count();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventDestroy(CUevent event) {
+	delete (event_state *)event;
+	return CUDA_SUCCESS;
+}
+
+const char *cudaGetErrorString(cudaError_t error) {
+	return error_name(error);
+}
+
+cudaError_t cudaSetDevice(int device) {
+	return device == 0 ? cudaSuccess : cudaErrorInvalidValue;
+}
+
+cudaError_t cudaGetDevice(int *device) {
+	*device = 0;
+	return cudaSuccess;
+}
+
+cudaError_t cudaDeviceGetAttribute(int *value, cudaDeviceAttr attr, int) {
+	*value = device_attribute(attr);
+	return *value >= 0 ? cudaSuccess : cudaErrorInvalidValue;
+}
+
+cudaError_t cudaDeviceSynchronize(void) {
+	return synchronize_all();
+}
+
+cudaError_t cudaMalloc(void **ptr, size_t size) {
+	return cuMemAlloc((CUdeviceptr *)ptr, size) == CUDA_SUCCESS ? cudaSuccess : cudaErrorMemoryAllocation;
+}
+
+cudaError_t cudaFree(void *ptr) {
+	free(ptr);
+	return cudaSuccess;
+}
+
+cudaError_t cudaMallocHost(void **ptr, size_t size) {
+	return cudaMalloc(ptr, size);
+}
+
+cudaError_t cudaFreeHost(void *ptr) {
+	free(ptr);
+	return cudaSuccess;
+}
+
+cudaError_t cudaMemcpy(void *dst, const void *src, size_t count, cudaMemcpyKind) {
+	return copy(dst, src, count, nullptr, true);
+}
+
+cudaError_t cudaMemcpyAsync(void *dst, const void *src, size_t count, cudaMemcpyKind, cudaStream_t stream) {
+	return copy(dst, src, count, stream, false);
+}
+
+cudaError_t cudaMemcpyPeerAsync(void *dst, int, const void *src, int, size_t count, cudaStream_t stream) {
+	return copy(dst, src, count, stream, false);
+}
+
+cudaError_t cudaStreamCreate(cudaStream_t *stream) {
+	return cuStreamCreate(stream, 0);
+}
+
+cudaError_t cudaStreamDestroy(cudaStream_t stream) {
+	return cuStreamDestroy(stream);
+}
+
+cudaError_t cudaStreamWaitEvent(cudaStream_t stream, cudaEvent_t event, unsigned int flags) {
+	return cuStreamWaitEvent(stream, event, flags);
+}
+
+cudaError_t cudaStreamSynchronize(cudaStream_t stream) {
+	return cuStreamSynchronize(stream);
+}
+
+cudaError_t cudaEventCreate(cudaEvent_t *event) {
+	return cuEventCreate(event, 0);
+}
+
+cudaError_t cudaEventRecord(cudaEvent_t event, cudaStream_t stream) {
+	return cuEventRecord(event, stream);
+}
+
+cudaError_t cudaEventSynchronize(cudaEvent_t event) {
+	return cuEventSynchronize(event);
+}
+
+cudaError_t cudaEventElapsedTime(float *ms, cudaEvent_t start, cudaEvent_t end) {
+	return cuEventElapsedTime(ms, start, end);
+}
+
+cudaError_t cudaEventDestroy(cudaEvent_t event) {
+	return cuEventDestroy(event);
+}
+
+}
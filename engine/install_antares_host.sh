@@ -11,7 +11,9 @@ rm -rf $TVM_HOME && git clone https://github.com/apache/incubator-tvm $TVM_HOME
 
 pip3 install --upgrade pip cmake==3.18.0 && \
   cp -r ${ANTARES_ROOT}/engine/device-stub ${TVM_HOME}/device-stub && \
-  echo '' > /tmp/device-stub.c && gcc /tmp/device-stub.c -shared -o ${TVM_HOME}/device-stub/lib64/libcudart.so
+  mkdir -p ${TVM_HOME}/device-stub/targets/x86_64-linux/lib && \
+  g++ ${TVM_HOME}/device-stub/src/cuda_emulator.cc -I${TVM_HOME}/device-stub/include -std=c++11 -O2 -shared -fPIC -lpthread -ldl -o ${TVM_HOME}/device-stub/lib64/libcudart.so && \
+  for LIB in libcuda libcudadevrt libcudart_static libnvrtc; do ln -sf libcudart.so ${TVM_HOME}/device-stub/lib64/${LIB}.so; done
 
 cd $TVM_HOME && git checkout 73f425d && git apply device-stub/tvm_v0.7.patch && \
   git submodule init && git submodule update && \
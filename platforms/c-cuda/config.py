@@ -3,14 +3,20 @@
 
 import subprocess, os
 
+cuda_home = os.environ.get('CUDA_HOME', '/usr/local/cuda')
+
 def get_execution_parallism():
-  return len(subprocess.getoutput('ls /dev/nvidia[0-9]* 2>/dev/null').split())
+  num_gpus = len(subprocess.getoutput('ls /dev/nvidia[0-9]* 2>/dev/null').split())
+  # CUDA_HOME of engine/device-stub emulates a single device on the host
+  if num_gpus == 0 and os.path.exists('%s/include/cuda_emulation.h' % cuda_home):
+    return 1
+  return num_gpus
 
 def get_compile_kernel_args(kernel_src, kernel_out, device_props):
   code_arch = device_props.compute_version.replace('.', '')
   assert 0 == os.system('ln -sf %s %s.cu' % (kernel_src, kernel_src))
-  # os.system(' '.join(['/usr/local/cuda/bin/nvcc', kernel_src + '.cu', '--ptx', '-O2', '-gencode', 'arch=compute_%s,code=sm_%s' % (code_arch, code_arch), '-o', '%s.ptx' % kernel_src]))
-  return ['/usr/local/cuda/bin/nvcc', kernel_src + '.cu', '--fatbin', '-O2', '-gencode', 'arch=compute_%s,code=sm_%s' % (code_arch, code_arch), '-o', kernel_out]
+  # os.system(' '.join([cuda_home + '/bin/nvcc', kernel_src + '.cu', '--ptx', '-O2', '-gencode', 'arch=compute_%s,code=sm_%s' % (code_arch, code_arch), '-o', '%s.ptx' % kernel_src]))
+  return [cuda_home + '/bin/nvcc', kernel_src + '.cu', '--fatbin', '-O2', '-gencode', 'arch=compute_%s,code=sm_%s' % (code_arch, code_arch), '-o', kernel_out]
 
 def do_native_translation(code, **kwargs):
   headers = ['#include <cuda_runtime.h>', '#include <cuda_fp16.h>', '#include <mma.h>']
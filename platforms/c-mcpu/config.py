@@ -1,6 +1,7 @@
 # Copyright (c) Microsoft Corporation.
 # Licensed under the MIT license.
 
+import re
 import subprocess
 
 from antares.common import type_to_c as _native_dtype, AntaresGlobal
@@ -17,7 +18,9 @@ def allow_concurrent_compile_execution():
 def remove_local_cache(code, arg_bufs):
     result = []
     for line in code.split('\n'):
-      if line.endswith('];') and line.find('=') < 0:
+      # register tiles (cache_write), rfactor partials and reduction scratch stay real local arrays
+      if line.endswith('];') and line.find('=') < 0 and not line.strip().startswith('static ') and \
+          not re.match(r'(\w+_local|\w+_rf|red_buf\d*|normal_reduce_temp\d*|mask|t\d+)$', line.split('[')[0].split()[-1]):
         output_buf = arg_bufs['_out'][0]
         print(line.split()[0], output_buf['dtype'])
         if line.split()[0] != _native_dtype(output_buf['dtype']):
@@ -26,6 +29,202 @@ def remove_local_cache(code, arg_bufs):
       result.append(line)
     return '\n'.join(result)
 
+# TVM prints vectorized loads, stores and ramps with CUDA's floatN / make_floatN vocabulary.
+# Each type wraps a GCC vector of N lanes, aligned like its element so that unaligned
+# tensor offsets stay legal, and exposes the lanes as .x/.y/.z/.w as CUDA does.
+def vector_types(code):
+  result = ''
+  for ctype, prefix in (('float', 'float'), ('double', 'double'), ('int', 'int'), ('unsigned int', 'uint')):
+    for lanes in (2, 4):
+      name, fields = '%s%d' % (prefix, lanes), 'xyzw'[:lanes]
+      if not re.search(r'\b%s\b' % name, code):
+        continue
+      result += 'struct %s {\n' % name
+      result += '  typedef %s vec_type __attribute__((vector_size(sizeof(%s) * %d), aligned(sizeof(%s))));\n' % (ctype, ctype, lanes, ctype)
+      result += '  union { vec_type v; struct { %s %s; }; };\n' % (ctype, ', '.join(fields))
+      for op in '+-*/':
+        result += '  inline %s operator%s(const %s &other) const { %s r; r.v = v %s other.v; return r; }\n' % (name, op, name, name, op)
+      result += '};\n'
+      result += 'inline %s make_%s(%s) { %s r; r.v = (%s::vec_type){%s}; return r; }\n' % (
+        name, name, ', '.join(['%s %s' % (ctype, x) for x in fields]), name, name, ', '.join(fields))
+  return result
+
+def mark_innermost_loops(code):
+  # the index arithmetic TVM emits is often too complex for GCC to prove the iterations independent
+  lines = code.split('\n')
+  result = []
+  for i, line in enumerate(lines):
+    if line.strip().startswith('for ('):
+      depth, innermost = 0, True
+      for j, next_line in enumerate(lines[i:]):
+        if j > 0 and next_line.strip().startswith('for ('):
+          innermost = False
+          break
+        depth += next_line.count('{') - next_line.count('}')
+        if depth <= 0:
+          break
+      if innermost:
+        result.append(line[:len(line) - len(line.lstrip())] + '#pragma GCC ivdep')
+    result.append(line)
+  return '\n'.join(result)
+
+# float16 and bfloat16 are storage types, arithmetic promotes to float. `half` is the
+# compiler's _Float16 where it exists, whose conversions GCC vectorizes to F16C (or computes
+# natively with AVX512-FP16), otherwise a struct converting with F16C or in software.
+# `bfloat16` is the upper half of a float, rounded to nearest even when stored.
+def reduced_precision_types(code):
+  result = ''
+  if re.search(r'\bhalf\b', code):
+    result += '''#if defined(__FLT16_MAX__)
+typedef _Float16 half;
+#else
+#include <immintrin.h>
+struct half {
+  unsigned short bits;
+  half() = default;
+  half(float f) {
+#if defined(__F16C__)
+    bits = _cvtss_sh(f, 0);
+#else
+    unsigned x, sign;
+    memcpy(&x, &f, sizeof(x));
+    sign = (x >> 16) & 0x8000, x &= 0x7fffffff;
+    if (x >= 0x7f800000)
+      bits = sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+    else if (x >= 0x477ff000)
+      bits = sign | 0x7c00;
+    else if (x < 0x38800000) {
+      // subnormal, let the FPU round it into the low mantissa bits of 0.5f
+      float a;
+      memcpy(&a, &x, sizeof(a));
+      a += 0.5f;
+      memcpy(&x, &a, sizeof(x));
+      bits = sign | (x - 0x3f000000);
+    } else
+      bits = sign | ((x + 0xfff + ((x >> 13) & 1) - 0x38000000) >> 13);
+#endif
+  }
+  operator float() const {
+#if defined(__F16C__)
+    return _cvtsh_ss(bits);
+#else
+    unsigned sign = unsigned(bits & 0x8000) << 16, exponent = (bits >> 10) & 0x1f, mantissa = bits & 0x3ff, x;
+    if (exponent == 0x1f)
+      x = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent)
+      x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else {
+      float f = mantissa * 5.9604644775390625e-8f;
+      memcpy(&x, &f, sizeof(x));
+      x |= sign;
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+#endif
+  }
+};
+#endif
+
+#define __float2half_rn(x) half(float(x))
+#define __half2float(x) float(x)
+'''
+    for fn in ('exp', 'exp2', 'exp10', 'log', 'log2', 'log10', 'sqrt', 'sin', 'cos', 'floor', 'ceil', 'trunc'):
+      result += 'inline half h%s(half x) { return half(%sf(float(x))); }\n' % (fn, fn)
+    result += 'inline half hrsqrt(half x) { return half(1.0f / sqrtf(float(x))); }\n'
+    result += 'inline half hrint(half x) { return half(rintf(float(x))); }\n\n'
+  if re.search(r'\bbfloat16\b', code):
+    result += '''struct bfloat16 {
+  unsigned short bits;
+  bfloat16() = default;
+  bfloat16(float f) {
+    unsigned x;
+    memcpy(&x, &f, sizeof(x));
+    bits = (x & 0x7fffffff) > 0x7f800000 ? (x >> 16) | 0x40 : (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+  }
+  operator float() const {
+    unsigned x = unsigned(bits) << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+  }
+};
+
+'''
+  return result
+
+# Register tiles, rfactor partials and reduction scratch of reduced precision outputs are
+# kept in float, so reductions accumulate in fp32 and round only when written back. That
+# includes the static red_buf of cross-rank reductions, whose volatile accesses are cast
+# along, and the t<N> values shuffled between ranks.
+def widen_accumulators(code):
+  code = re.sub(r'^(\s*(?:static\s+)?)(?:half|bfloat16)(\s+(?:\w*_local|\w*_rf|red_buf\d*|normal_reduce_temp\d*|t\d+)\[)', r'\1float\2', code, flags=re.M)
+  return re.sub(r'\((volatile\s+)?(?:half|bfloat16)\s*\*\s*\)(\s*red_buf\d*\b)', r'(\1float*)\2', code)
+
+# Cross-rank reductions (rfactor + threadIdx.x) are lowered the CUDA way: __shared__ buffers,
+# __syncthreads() and warp shuffles. All ranks of one launch run concurrently in one process,
+# so shared buffers become statics and every sync is a spinning barrier over all the ranks.
+def rank_sync_runtime(code):
+  if not re.search(r'\b(__syncthreads|__shfl_\w+|__activemask)\b', code):
+    return ''
+  ranks = int(re.search(r'// \[thread_extent\] __rank__ = (\d+)', code).group(1))
+  return '''#include <sched.h>
+
+#define __RANKS__ %d
+static std::atomic<int> __sync_arrived(0), __sync_phase(0);
+
+inline void __syncthreads() {
+  int phase = __sync_phase.load(std::memory_order_acquire);
+  if (__sync_arrived.fetch_add(1, std::memory_order_acq_rel) == __RANKS__ - 1) {
+    __sync_arrived.store(0, std::memory_order_relaxed);
+    __sync_phase.store(phase + 1, std::memory_order_release);
+    return;
+  }
+  for (int spin = 1; __sync_phase.load(std::memory_order_acquire) == phase; ++spin)
+    if ((spin & 1023) == 0)
+      sched_yield();
+}
+
+inline void __threadfence_block() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+inline unsigned __activemask() { return 0xffffffffu; }
+
+// a shuffle is an exchange through one slot per rank, fenced by two barriers
+static unsigned long long __shfl_slots[__RANKS__];
+template<class T> inline T __shfl_exchange(T value, int src, int self) {
+  static_assert(sizeof(T) <= sizeof(unsigned long long), "shuffled value is too wide");
+  memcpy(&__shfl_slots[self], &value, sizeof(T));
+  __syncthreads();
+  T result;
+  memcpy(&result, &__shfl_slots[src], sizeof(T));
+  __syncthreads();
+  return result;
+}
+template<class T> inline T __shfl_down_impl(T value, int delta, int width, int rank) {
+  return __shfl_exchange(value, (rank %% width) + delta < width && rank + delta < __RANKS__ ? rank + delta : rank, rank);
+}
+template<class T> inline T __shfl_impl(T value, int lane, int width, int rank) {
+  return __shfl_exchange(value, rank - rank %% width + lane, rank);
+}
+#define __shfl_down_sync(mask, value, delta, width) __shfl_down_impl(value, delta, width, __rank__)
+#define __shfl_sync(mask, value, lane, width) __shfl_impl(value, lane, width, __rank__)
+
+''' % ranks
+
+# Dynamic chunking: threadIdx.x numbers chunks instead of ranks, and every rank keeps claiming
+# the next chunk from a counter. The counter is never reset, each launch takes chunks + ranks
+# consecutive claims (every rank stops at its first claim past the last chunk), so the claim
+# modulo that count is the chunk of the current launch.
+def dynamic_chunks(code, chunks_per_rank):
+  extent = re.search(r'\n( *)// \[thread_extent\] threadIdx\.x = (\d+)\n', code)
+  indent, chunks = extent.group(1), int(extent.group(2))
+  ranks = max(1, chunks // chunks_per_rank)
+  end = code.rindex('}')
+  body = ''.join(['  ' + line if line.strip() else line for line in code[extent.end():end].splitlines(True)])
+  loop = indent + '// [thread_extent] __rank__ = %d\n' % ranks
+  loop += indent + 'static std::atomic<unsigned long long> __chunk_claims(0);\n'
+  loop += indent + 'for (int __chunk__; (__chunk__ = int(__chunk_claims.fetch_add(1, std::memory_order_relaxed) %% %d)) < %d; ) {\n' % (chunks + ranks, chunks)
+  return code[:extent.start() + 1] + loop + body.replace('threadIdx.x', '__chunk__') + indent + '}\n' + code[end:]
+
 def do_native_translation(code, **kwargs):
     arg_bufs = AntaresGlobal.local_arg_pros
 
@@ -38,9 +237,21 @@ def do_native_translation(code, **kwargs):
     for buf in arg_bufs['_out']:
       args.append((_native_dtype(buf['dtype']), buf['name']))
 
-    code = 'extern "C" void kernel_main(%s) {\n  // [thread_compute]\n' % ', '.join([t + '* ' + v for t, v in args]) + code[tail + len(") {\n"):]
-    code = code.replace('threadIdx.x', '__rank__').replace(' __global__ ', ' ').replace(' __restrict__ ', ' ')
-    code = '#include <math.h>\n#include <algorithm>\nusing namespace std;\n\n' + kwargs['attrs'].blend + '\n' + code
-    code = code + '\n#ifdef __fp16\ntypedef __fp16 half\n#endif\n'
+    # tensors never overlap, which is what lets GCC vectorize across them
+    body = code[tail + len(") {\n"):].replace(' __restrict__ ', ' ')
+    code = 'extern "C" void kernel_main(%s) {\n  // [thread_compute]\n' % ', '.join([t + '* __restrict__ ' + v for t, v in args]) + body
+    chunks_per_rank = getattr(kwargs['attrs'], 'rank_chunks', 0)
+    if chunks_per_rank and re.search(r'// \[thread_extent\] threadIdx\.x = ', code):
+      code = dynamic_chunks(code, chunks_per_rank)
+    code = code.replace('threadIdx.x', '__rank__').replace(' __global__ ', ' ')
+    code = re.sub(r'\b__shared__\b', 'static', code)
+    code = mark_innermost_loops(code)
+    # only the kernel itself, the blend may declare arrays of its own
     code = remove_local_cache(code, arg_bufs)
+    code = widen_accumulators(code)
+    # launch options chosen by the schedule travel with the kernel, the harness applies them
+    launch_options = getattr(kwargs['attrs'], 'launch_options', {})
+    if launch_options:
+      code = '// [launch_options] %s\n' % ' '.join(['%s=%s' % (k, launch_options[k]) for k in sorted(launch_options)]) + code
+    code = '#include <math.h>\n#include <string.h>\n#include <algorithm>\n#include <atomic>\nusing namespace std;\n\n' + reduced_precision_types(code + kwargs['attrs'].blend) + vector_types(code) + rank_sync_runtime(code) + kwargs['attrs'].blend + '\n' + code
     return code
@@ -14,19 +14,27 @@ except:
     traceback.print_exc()
     exit(1)
 
+# Environment variables that select harness behavior, passed along with every kernel of the tuning job
+harness_options = ['CPU_LAUNCH', 'CPU_TIME_BUDGET', 'CPU_TARGET_CI', 'CPU_MIN_SAMPLES', 'FLUSH_MEM', 'CPU_COUNTERS', 'CPU_HUGE_PAGES', 'CPU_AFFINITY']
+
 def eval(kernel_path, **kwargs):
     with open(kernel_path, 'rb') as fp:
         kernel_data = fp.read()
 
+    options = {k: os.environ[k] for k in harness_options if k in os.environ}
+    # the harness gives up on candidates that are provably slower than the current best
+    options['EXPECTED_TIMEOUT'] = str(kwargs.get('expected_timeout', ''))
+
     output_content = ''
     if not os.environ.get('AGENT_URL', ''):
         curr_dir = os.getcwd()
         os.chdir(os.path.join(curr_dir, 'platforms/c-mcpu/evaluator/eval_agent'))
-        ret, output_content = eval_agent.profile_kernel(kernel_data.decode())
+        ret, output_content = eval_agent.profile_kernel(kernel_data.decode(), options)
         os.chdir(curr_dir)
     else:
         tune_agent_url = 'http://' + os.environ['AGENT_URL']
-        req = urllib.request.Request(tune_agent_url, headers={}, data=kernel_data, method='PUT')
+        headers = {'X-Antares-' + k: options[k] for k in options}
+        req = urllib.request.Request(tune_agent_url, headers=headers, data=kernel_data, method='PUT')
         with urllib.request.urlopen(req) as fp:
             output_content = fp.read().decode()
 
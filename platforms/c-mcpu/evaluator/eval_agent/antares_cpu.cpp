@@ -0,0 +1,327 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Implementation of the C API in antares_cpu.h.
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <sched.h>
+#include "threadpool.h"
+#include "thread_team.h"
+#include "cpu_topology.h"
+#include "antares_cpu.h"
+
+typedef void (*entry_func)(void **args, int rank);
+
+static std::string get_between(const std::string &str, const std::string &begin, const std::string &end, const std::string &def_ret = "") {
+    int at = str.find(begin);
+    if (at < 0)
+        return def_ret;
+    at += begin.size();
+    int next = str.find(end, at);
+    if (next < at)
+        return def_ret;
+    return str.substr(at, next - at);
+}
+
+static std::vector<std::string> ssplit(const std::string &str, const std::string &sub) {
+    std::vector<std::string> ret;
+    int it = 0, next;
+    while (next = str.find(sub, it), next >= 0) {
+        ret.push_back(str.substr(it, next - it));
+        it = next + sub.size();
+    }
+    ret.push_back(str.substr(it));
+    return ret;
+}
+
+struct tensor_property {
+    std::string name, dtype;
+    std::vector<size_t> shape;
+
+    size_t element_size() const {
+        return std::accumulate(shape.begin(), shape.end(), (size_t)1L, std::multiplies<size_t>());
+    }
+
+    int type_size() const {
+        for (int i = dtype.size() - 1; i >= 0; --i) {
+            if (!isdigit(dtype[i])) {
+                int bits = std::atoi(dtype.substr(i + 1).c_str());
+                assert((bits & 7) == 0);
+                return bits >> 3;
+            }
+        }
+        throw std::runtime_error(("Unrecognized type size for `" + dtype + "`").c_str());
+    }
+
+    size_t byte_size() const {
+        return element_size() * type_size();
+    }
+};
+
+static std::vector<tensor_property> parse_properties(const std::string &encoded_inputs) {
+    if (encoded_inputs.size() == 0)
+      return {};
+    std::vector<tensor_property> ret;
+    for (auto it: ssplit(encoded_inputs, ",")) {
+      auto props = ssplit(it, "/");
+      if (props.size() != 3)
+        throw std::runtime_error(("Invalid tensor property `" + it + "`").c_str());
+      tensor_property tp;
+      for (auto d: ssplit(props[0], "-"))
+        tp.shape.push_back(std::atol(d.c_str()));
+      tp.dtype = props[1];
+      tp.name = props[2];
+      ret.push_back(tp);
+    }
+    return ret;
+}
+
+typedef std::map<std::string, std::string> options_t;
+
+// adds `KEY=VAL KEY=VAL` items, keeping keys that are set already
+static void merge_options(options_t &options, const std::string &encoded) {
+    for (auto &item: ssplit(encoded, " ")) {
+        auto at = item.find('=');
+        if (at != std::string::npos)
+            options.insert({item.substr(0, at), item.substr(at + 1)});
+    }
+}
+
+// Owns the thread team (or pool) the kernels are launched on, recreated only
+// when the rank count, the launch mode or the placement policy changes.
+class launcher {
+public:
+    launcher() : ranks(0), use_pool(false) {
+        sched_getaffinity(0, sizeof(process_mask), &process_mask);
+    }
+
+    void prepare(int num_ranks, bool pool_mode, const std::string &affinity) {
+        if (num_ranks == ranks && pool_mode == use_pool && affinity == policy && (team || pool))
+            return;
+        team.reset();
+        pool.reset();
+        ranks = num_ranks, use_pool = pool_mode, policy = affinity;
+
+        // a previous team pinned this thread, start again from the process mask
+        sched_setaffinity(0, sizeof(process_mask), &process_mask);
+        std::vector<int> placement = place_ranks(ranks, policy);
+        if (!use_pool) {
+            team.reset(new ThreadTeam(ranks, 1 << 20, placement));
+            return;
+        }
+        // the pool is not pinned, keep its workers on the CPUs the ranks are placed on
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (int cpu: placement)
+            CPU_SET(cpu, &mask);
+        if (!placement.empty())
+            sched_setaffinity(0, sizeof(mask), &mask);
+        pool.reset(new ThreadPool(ranks));
+    }
+
+    template<class F>
+    void run(F&& fn) {
+        if (team)
+            team->run(fn);
+        else
+            pool->parallel_for(ranks, fn);
+    }
+
+private:
+    cpu_set_t process_mask;
+    int ranks;
+    bool use_pool;
+    std::string policy;
+    std::unique_ptr<ThreadTeam> team;
+    std::unique_ptr<ThreadPool> pool;
+};
+
+struct antares_cpu_runtime {
+    launcher team;
+    void (*hook)(void *, int) = nullptr;
+    void *hook_ctx = nullptr;
+};
+
+struct antares_cpu_kernel {
+    antares_cpu_runtime *runtime;
+    std::unique_ptr<void, int (*)(void *)> library{nullptr, dlclose};
+    entry_func entry = nullptr;
+    int num_inputs = 0, ranks = 0;
+    std::vector<tensor_property> properties;
+    std::vector<antares_cpu_tensor> tensors;
+    std::vector<void *> args;
+    options_t options;
+    std::string affinity;
+    bool use_pool = false;
+};
+
+static thread_local std::string last_error;
+
+template<class F>
+static int guarded(F&& fn) {
+    try {
+        fn();
+        return 0;
+    } catch (std::exception &e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+extern "C" {
+
+antares_cpu_runtime *antares_cpu_create(void) {
+    antares_cpu_runtime *runtime = nullptr;
+    guarded([&]() { runtime = new antares_cpu_runtime(); });
+    return runtime;
+}
+
+void antares_cpu_destroy(antares_cpu_runtime *runtime) {
+    delete runtime;
+}
+
+void antares_cpu_set_rank_hook(antares_cpu_runtime *runtime, void (*hook)(void *ctx, int rank), void *ctx) {
+    runtime->hook = hook;
+    runtime->hook_ctx = ctx;
+}
+
+antares_cpu_kernel *antares_cpu_load(antares_cpu_runtime *runtime, const char *library_path, const char *source_path, const char *options) {
+    std::unique_ptr<antares_cpu_kernel> kernel(new antares_cpu_kernel());
+    kernel->runtime = runtime;
+    int ret = guarded([&]() {
+        void *handle = dlopen(library_path, RTLD_NOW | RTLD_LOCAL);
+        if (!handle)
+            throw std::runtime_error(dlerror());
+        kernel->library.reset(handle);
+        kernel->entry = (entry_func)dlsym(handle, "antares_entry");
+        if (!kernel->entry)
+            throw std::runtime_error("Symbol `antares_entry` is not found in kernel library.");
+
+        std::string metadata;
+        if (const char *embedded = (const char *)dlsym(handle, "antares_metadata")) {
+            metadata = embedded;
+        } else if (source_path) {
+            std::ifstream t(source_path);
+            if (!t)
+                throw std::runtime_error((std::string("Failed to open kernel source: ") + source_path).c_str());
+            metadata.assign((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+        } else {
+            throw std::runtime_error("Kernel library carries no `antares_metadata`, and no kernel source is given.");
+        }
+
+        auto params = ssplit(get_between(metadata, "///", "\n"), ":");
+        if (params.size() != 2)
+            throw std::runtime_error("Invalid kernel header: `///` properties are not found.");
+        auto inputs = parse_properties(params[0]), outputs = parse_properties(params[1]);
+        kernel->num_inputs = inputs.size();
+        kernel->properties = inputs;
+        kernel->properties.insert(kernel->properties.end(), outputs.begin(), outputs.end());
+        kernel->ranks = std::atoi(get_between(metadata, "__rank__ = ", "\n", "0").c_str());
+        if (kernel->ranks <= 0)
+            throw std::runtime_error("Invalid kernel header: `__rank__` extent is not found.");
+
+        for (auto &it: kernel->properties) {
+            antares_cpu_tensor tensor = {it.name.c_str(), it.dtype.c_str(), int(it.shape.size()), it.shape.data(), it.byte_size()};
+            kernel->tensors.push_back(tensor);
+        }
+        kernel->args.assign(kernel->properties.size(), nullptr);
+
+        merge_options(kernel->options, options ? options : "");
+        merge_options(kernel->options, get_between(metadata, "// [launch_options] ", "\n"));
+        const char *launch = antares_cpu_option(kernel.get(), "CPU_LAUNCH");
+        const char *affinity = antares_cpu_option(kernel.get(), "CPU_AFFINITY");
+        kernel->use_pool = launch && std::string(launch) == "pool";
+        kernel->affinity = affinity ? affinity : "";
+        // fail on a bad placement policy here rather than on the first launch
+        place_ranks(kernel->ranks, kernel->affinity);
+    });
+    return ret == 0 ? kernel.release() : nullptr;
+}
+
+void antares_cpu_unload(antares_cpu_kernel *kernel) {
+    delete kernel;
+}
+
+int antares_cpu_num_inputs(const antares_cpu_kernel *kernel) {
+    return kernel->num_inputs;
+}
+
+int antares_cpu_num_outputs(const antares_cpu_kernel *kernel) {
+    return int(kernel->tensors.size()) - kernel->num_inputs;
+}
+
+int antares_cpu_num_ranks(const antares_cpu_kernel *kernel) {
+    return kernel->ranks;
+}
+
+const antares_cpu_tensor *antares_cpu_tensor_info(const antares_cpu_kernel *kernel, int index) {
+    if (index < 0 || index >= int(kernel->tensors.size())) {
+        last_error = "Tensor index " + std::to_string(index) + " is out of range.";
+        return nullptr;
+    }
+    return &kernel->tensors[index];
+}
+
+const char *antares_cpu_option(const antares_cpu_kernel *kernel, const char *key) {
+    auto it = kernel->options.find(key);
+    if (it != kernel->options.end())
+        return it->second.c_str();
+    return getenv(key);
+}
+
+int antares_cpu_bind(antares_cpu_kernel *kernel, int index, void *data) {
+    return guarded([&]() {
+        if (index < 0 || index >= int(kernel->args.size()))
+            throw std::runtime_error(("Tensor index " + std::to_string(index) + " is out of range.").c_str());
+        kernel->args[index] = data;
+    });
+}
+
+int antares_cpu_launch(antares_cpu_kernel *kernel) {
+    return guarded([&]() {
+        for (void *arg: kernel->args)
+            if (!arg)
+                throw std::runtime_error("Every tensor must be bound before launching the kernel.");
+        antares_cpu_runtime *runtime = kernel->runtime;
+        runtime->team.prepare(kernel->ranks, kernel->use_pool, kernel->affinity);
+        entry_func entry = kernel->entry;
+        void **args = kernel->args.data();
+        if (runtime->hook) {
+            runtime->team.run([=](int rank) {
+                runtime->hook(runtime->hook_ctx, rank);
+                entry(args, rank);
+            });
+        } else {
+            runtime->team.run([=](int rank) { entry(args, rank); });
+        }
+    });
+}
+
+int antares_cpu_parallel(antares_cpu_kernel *kernel, void (*fn)(void *ctx, int rank), void *ctx) {
+    return guarded([&]() {
+        kernel->runtime->team.prepare(kernel->ranks, kernel->use_pool, kernel->affinity);
+        kernel->runtime->team.run([=](int rank) { fn(ctx, rank); });
+    });
+}
+
+void antares_cpu_run_rank(antares_cpu_kernel *kernel, int rank) {
+    kernel->entry(kernel->args.data(), rank);
+}
+
+const char *antares_cpu_last_error(void) {
+    return last_error.c_str();
+}
+
+}
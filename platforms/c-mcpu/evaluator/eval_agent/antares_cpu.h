@@ -0,0 +1,102 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef ANTARES_CPU_H
+#define ANTARES_CPU_H
+
+// Embeddable runtime for tuned c-mcpu kernels, the same code the resident
+// harness benchmarks them with. A kernel library is the shared object built by
+// the eval agent: it exports `antares_entry(void **args, int rank)` and the
+// kernel header (`///` tensor properties, `__rank__` extent and tuned
+// `// [launch_options]`) as `antares_metadata`. Build the runtime with:
+//
+//   g++ antares_cpu.cpp -o libantares_cpu.so -std=c++11 -O3 -march=native -shared -fPIC -lpthread -ldl
+//
+// Typical use:
+//
+//   antares_cpu_runtime *rt = antares_cpu_create();
+//   antares_cpu_kernel *k = antares_cpu_load(rt, "kernel.so", NULL, NULL);
+//   for (int i = 0; i < antares_cpu_num_inputs(k) + antares_cpu_num_outputs(k); ++i)
+//       antares_cpu_bind(k, i, buffers[i]);     // inputs first, then outputs
+//   antares_cpu_launch(k);                      // as often as needed
+//
+// The ranks of a launch run on a thread team owned by the runtime, which stays
+// alive across launches. The team is rebuilt only when a launch needs another
+// rank count or placement than the previous one, so kernels of one runtime
+// should agree on both; otherwise give each group of kernels its own runtime.
+// A launch performs no allocation. One runtime launches one kernel at a time.
+//
+// Launch options resolve in this order: the `options` string passed to
+// antares_cpu_load ("KEY=VAL KEY=VAL"), the tuned launch options of the
+// kernel, then environment variables. The runtime reads CPU_AFFINITY
+// (compact, scatter or numa placement of the ranks) and CPU_LAUNCH=pool (the
+// work-stealing pool instead of the pinned team); other keys are kept for the
+// caller, see antares_cpu_option.
+//
+// Functions returning int return 0 on success; on failure they, and functions
+// returning NULL, leave a message for antares_cpu_last_error.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct antares_cpu_runtime antares_cpu_runtime;
+typedef struct antares_cpu_kernel antares_cpu_kernel;
+
+typedef struct antares_cpu_tensor {
+    const char *name;
+    const char *dtype;
+    int ndim;
+    const size_t *shape;
+    size_t bytes;
+} antares_cpu_tensor;
+
+antares_cpu_runtime *antares_cpu_create(void);
+void antares_cpu_destroy(antares_cpu_runtime *runtime);
+
+// Called by every rank right before the kernel body on each launch, e.g. to
+// attach per-thread profilers. NULL removes the hook.
+void antares_cpu_set_rank_hook(antares_cpu_runtime *runtime, void (*hook)(void *ctx, int rank), void *ctx);
+
+// `source_path` is only read when the library carries no `antares_metadata`.
+antares_cpu_kernel *antares_cpu_load(antares_cpu_runtime *runtime, const char *library_path, const char *source_path, const char *options);
+void antares_cpu_unload(antares_cpu_kernel *kernel);
+
+int antares_cpu_num_inputs(const antares_cpu_kernel *kernel);
+int antares_cpu_num_outputs(const antares_cpu_kernel *kernel);
+int antares_cpu_num_ranks(const antares_cpu_kernel *kernel);
+// tensor `index` counts inputs first, then outputs; NULL when out of range
+const antares_cpu_tensor *antares_cpu_tensor_info(const antares_cpu_kernel *kernel, int index);
+// the resolved value of a launch option, NULL when it is set nowhere
+const char *antares_cpu_option(const antares_cpu_kernel *kernel, const char *key);
+
+int antares_cpu_bind(antares_cpu_kernel *kernel, int index, void *data);
+// Runs all ranks of the kernel on the bound tensors and waits for them.
+//
+// The calling thread takes part as rank 0. With the pinned team it is pinned
+// to the CPU of rank 0 on its first launch, and again whenever the team is
+// rebuilt, and it stays pinned afterwards. With CPU_LAUNCH=pool its mask is
+// narrowed to the CPUs of the ranks. Launch from a thread of your own when
+// the affinity of the calling thread matters.
+//
+// A kernel library keeps launch state in statics: the chunk claim counter of
+// dynamic chunking and the barrier of cross-rank reductions. dlopen returns
+// the same library for the same file, so one kernel library must not be
+// launched concurrently, not even through two runtimes.
+int antares_cpu_launch(antares_cpu_kernel *kernel);
+// runs fn(ctx, rank) for every rank on the team the kernel launches on, for
+// work that must happen on the same threads, e.g. first touch of buffers
+int antares_cpu_parallel(antares_cpu_kernel *kernel, void (*fn)(void *ctx, int rank), void *ctx);
+// runs the kernel body of one rank on the calling thread
+void antares_cpu_run_rank(antares_cpu_kernel *kernel, int rank);
+
+// message of the last failure on the calling thread
+const char *antares_cpu_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <vector>
+#include <string>
+#include <tuple>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <dirent.h>
+
+// A logical CPU this process may run on, with its place in the machine.
+// `smt` numbers the hardware threads of one physical core from 0.
+struct cpu_place {
+    int cpu, package, core, node, smt;
+};
+
+inline int read_sysfs_int(const std::string &path, int def_val)
+{
+    std::ifstream fp(path);
+    int value;
+    return (fp >> value) ? value : def_val;
+}
+
+// CPUs of the process affinity mask (as set by taskset) in id order. Without
+// sysfs every CPU is its own core on package and node 0.
+inline std::vector<cpu_place> allowed_cpus()
+{
+    std::vector<cpu_place> places;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return places;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        std::string root = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        cpu_place place = {cpu, read_sysfs_int(root + "/topology/physical_package_id", 0),
+            read_sysfs_int(root + "/topology/core_id", cpu), 0, 0};
+        if (DIR *dir = opendir(root.c_str())) {
+            while (struct dirent *entry = readdir(dir)) {
+                if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+                    place.node = atoi(entry->d_name + 4);
+                    break;
+                }
+            }
+            closedir(dir);
+        }
+        for (auto &it: places)
+            if (it.package == place.package && it.core == place.core)
+                ++place.smt;
+        places.push_back(place);
+    }
+    return places;
+}
+
+// The CPU each rank is pinned to under a placement policy:
+//   (empty)  the r-th allowed CPU, wrapping around
+//   compact  all hardware threads of a core before moving to the next core
+//   scatter  one rank per physical core, SMT siblings only once every core is taken
+//   numa     ranks in contiguous blocks of one NUMA node each, scattered inside the node
+// Contiguous rank blocks per node keep the first-touch pages of a rank local to it.
+inline std::vector<int> place_ranks(int ranks, const std::string &policy)
+{
+    std::vector<cpu_place> places = allowed_cpus();
+    std::vector<int> cpus;
+    if (places.empty())
+        return cpus;
+
+    auto compact = [](const cpu_place &a, const cpu_place &b) {
+        return std::make_tuple(a.package, a.core, a.smt) < std::make_tuple(b.package, b.core, b.smt);
+    };
+    auto scatter = [](const cpu_place &a, const cpu_place &b) {
+        return std::make_tuple(a.smt, a.package, a.core) < std::make_tuple(b.smt, b.package, b.core);
+    };
+    if (policy == "compact") {
+        std::stable_sort(places.begin(), places.end(), compact);
+    } else if (policy == "scatter") {
+        std::stable_sort(places.begin(), places.end(), scatter);
+    } else if (policy == "numa") {
+        std::vector<int> nodes;
+        for (auto &it: places)
+            if (std::find(nodes.begin(), nodes.end(), it.node) == nodes.end())
+                nodes.push_back(it.node);
+        std::sort(nodes.begin(), nodes.end());
+        std::stable_sort(places.begin(), places.end(), scatter);
+        for (int rank = 0; rank < ranks; ++rank) {
+            // rank r belongs to node r * nodes / ranks, and is the i-th rank of that node
+            int node = int((long long)rank * nodes.size() / ranks), first = 0;
+            while (first < rank && int((long long)first * nodes.size() / ranks) != node)
+                ++first;
+            std::vector<int> node_cpus;
+            for (auto &it: places)
+                if (it.node == nodes[node])
+                    node_cpus.push_back(it.cpu);
+            cpus.push_back(node_cpus[(rank - first) % node_cpus.size()]);
+        }
+        return cpus;
+    } else if (!policy.empty()) {
+        throw std::runtime_error(("Unknown CPU_AFFINITY policy: " + policy).c_str());
+    }
+    for (int rank = 0; rank < ranks; ++rank)
+        cpus.push_back(places[rank % places.size()].cpu);
+    return cpus;
+}
+
+#endif
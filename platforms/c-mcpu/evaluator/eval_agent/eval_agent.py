@@ -3,13 +3,24 @@
 # Copyright (c) Microsoft Corporation.
 # Licensed under the MIT license.
 
+import os
+import re
 import sys
+import time
+import shutil
+import asyncio
+import tempfile
+import threading
+import atexit
+import select
+import hashlib
 import logging
 import subprocess
 import platform
+import contextlib
+from concurrent.futures import ThreadPoolExecutor
 
 if sys.platform == 'win32':
-    import asyncio
     asyncio.set_event_loop_policy(asyncio.WindowsSelectorEventLoopPolicy())
 
 import tornado.ioloop
@@ -18,20 +29,22 @@ from tornado import options
 
 logging.basicConfig(stream=sys.stdout, level=logging.INFO)
 
-def generate_source_file(kernel_code):
-    rank = 0
+agent_dir = os.path.dirname(os.path.abspath(__file__))
+
+def generate_kernel_code(kernel_code):
+    rank, failure = 0, (False, 0, None)
     pos = kernel_code.find('///')
     if pos == -1:
-        return False, rank
+        return failure
     pos += len('///')
 
     sep = kernel_code.find(':', pos)
     if sep == -1:
-        return False, rank
+        return failure
 
     tail = kernel_code.find('\n', sep)
     if tail == -1:
-        return False, rank
+        return failure
 
     input_str = kernel_code[pos:sep]
     output_str = kernel_code[sep + 1:tail]
@@ -42,25 +55,26 @@ def generate_source_file(kernel_code):
     rank_pattern = '__rank__ = '
     pos = kernel_code.find(rank_pattern)
     if pos == -1:
-        return False, rank
+        return failure
 
     tail = kernel_code.find('\n', pos)
     if tail == -1:
-        return False, rank
+        return failure
     rank = int(kernel_code[pos + len(rank_pattern):tail])
     
     # Insert rank parameter.
     pos = kernel_code.find('kernel_main')
     if pos == -1:
-        return False, rank
+        return failure
     tail = kernel_code.find(')', pos)
     if tail == -1:
-        return False, rank
+        return failure
     kernel_code = kernel_code[:tail] + ', int __rank__' + kernel_code[tail:]
 
     # Input and output.
     type_converter = {
         "float16": "half",
+        "bfloat16": "bfloat16",
         "float32": "float",
         "float64": "double",
         "int8": "char",
@@ -68,195 +82,329 @@ def generate_source_file(kernel_code):
         "int32": "int",
         "int64": "long",
     }
-    main_func_body = ""
     input_types = []
-    input_byte_size = []
     for i, input in enumerate(inputs):
         shape, type, name = input.split('/')
-        dims = list(filter(None, shape.split('-')))
-        size = 1
-        for dim in dims:
-            size *= int(dim)
-        idx = type.find("@")
-        if idx >= 0:
-            bits = int(type[idx + 1:])
+        if type.find("@") >= 0:
             type = "int8"
-            size = size * bits // 8
-            input_byte_size.append(size)
-        else:
-            input_byte_size.append(size * int(''.join(filter(str.isdigit, type))) // 8)
         if not type in type_converter:
-            return False, rank
+            return failure
         input_types.append(type_converter[type])
 
-        main_func_body += (type_converter[type] + '* input' + str(i) + ' = new ' + type_converter[type] + '[' + str(int(size)) + '];\n')
-        main_func_body += ('assert(' + str(input_byte_size[-1]) + ' % sizeof(int) == 0);\n')
-        if type == 'int32' or type == 'float32':
-            main_func_body += ('for( int i = 0; i < ' + str(int(size)) + '; ++i) {\n')
-            main_func_body += ('    input{}[i] = ({} + 1 + i) % 71;\n'.format(i, i))
-        else:
-            main_func_body += ('for( int i = 0; i < ' + str(input_byte_size[-1]) + ' / sizeof(int); ++i) {\n')
-            main_func_body += ('    ((int*)input{})[i] = ({} + 1 + i) % 71;\n'.format(i, i))
-        main_func_body += ('}\n')
-
     output_types = []
-    output_byte_size = []
     for i, output in enumerate(outputs):
         shape, type, name = output.split('/')
-        dims = list(filter(None, shape.split('-')))
-        size = 1
-        for dim in dims:
-            size *= int(dim)
-        idx = type.find("@")
-        if idx >= 0:
-            bits = int(type[idx + 1:])
+        if type.find("@") >= 0:
             type = "int8"
-            size = size * bits // 8
-            output_byte_size.append(size)
-        else:
-            output_byte_size.append(size * int(''.join(filter(str.isdigit, type))) // 8)
         if not type in type_converter:
-            return False, rank
+            return failure
         output_types.append(type_converter[type])
-        main_func_body += (type_converter[type]+ '* output' + str(i) + ' = new ' + type_converter[type]+ '[' + str(int(size)) + '];\n\n')
-
-    # Threadpool.
-    main_func_body += ('ThreadPool pool(' + str(rank) + ');\n')
-    main_func_body += ('std::vector< std::future<void> > results;\n')
-    main_func_body += ('results.reserve(' + str(rank) + ');\n\n')
-
-    # Lambda for testing kernel and timing.
-    main_func_body += ('std::chrono::high_resolution_clock::time_point t1, t2;\n')
-    main_func_body += ('auto run = [&](int run_times = 1) -> double {\n')
-    main_func_body += ('    t1 = std::chrono::high_resolution_clock::now();\n')
-    main_func_body += ('    for (int i = 0; i < run_times; ++i) {\n')
-    main_func_body += ('        results.clear();\n')
-    main_func_body += ('        for (int j = 0; j < ' + str(rank) + '; ++j) {\n')
-    main_func_body += ('            results.emplace_back(pool.enqueue(kernel_main');
-    for i in range(len(inputs)):
-        main_func_body += (', reinterpret_cast<{}*>(input{})'.format(input_types[i], str(i)))
-    for i in range(len(outputs)):
-        main_func_body += (', reinterpret_cast<{}*>(output{})'.format(output_types[i], str(i)))
-    main_func_body += (', j));\n')
-    main_func_body += ('        }\n')
-    main_func_body += ('        for(auto && result: results) {\n')
-    main_func_body += ('            result.get();\n')
-    main_func_body += ('        }\n')
-    main_func_body += ('    }\n')
-    main_func_body += ('    t2 = std::chrono::high_resolution_clock::now();\n')
-    main_func_body += ('    return std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count() / run_times;\n')
-    main_func_body += ('};\n\n')
-
-    # Warmup.
-    main_func_body += ('// Warmup.\n')
-    main_func_body += ('run(1);\n\n')
-
-    # Measure step time.
-    main_func_body += ('// Measure step time.\n')
-    main_func_body += ('double sec;\n')
-    main_func_body += ('sec = run(1);\n\n')
-    
-    # Adapt the test times.
-    main_func_body += ('// Adapt the test times.\n')
-    main_func_body += ('int test_run = 100;\n')
-    main_func_body += ('if ( sec >= 1) test_run = 3;\n')
-    main_func_body += ('if ( sec < 1 && sec >= 0.1) test_run = 10;\n')
-    main_func_body += ('if ( sec < 0.1 && sec >= 0.01) test_run = 100;\n')
-    main_func_body += ('if ( sec < 0.01 && sec >= 0.001) test_run = 1000;\n')
-    main_func_body += ('if ( sec < 0.001 && sec >= 0.0001) test_run = 10000;\n')
-    main_func_body += ('if ( sec < 0.0001) test_run = 100000;\n\n')
-
-    # Test.
-    main_func_body += ('// Testing.\n')
-    main_func_body += ('sec = run(test_run);\n\n')
-
-    main_func_body += ('double ans;\n')
-    for i, output in enumerate(outputs):
-        shape, type, name = output.split('/')
-        main_func_body += ('ans = 0;\n')
-        main_func_body += ('assert(' + str(output_byte_size[i]) + ' % sizeof(int) == 0);\n')
-        if type == 'int32':
-            main_func_body += ('for( int i = 0; i < ' + str(output_byte_size[i]) + ' / sizeof(int); ++i) {\n')
-            main_func_body += ('    ans += (i + 1) % 83 * (((int*)output' + str(i) + ')[i]);\n') 
-        else:
-            main_func_body += ('for( int i = 0; i < ' + str(output_byte_size[i]) + ' / sizeof(float); ++i) {\n')
-            main_func_body += ('    ans += (i + 1) % 83 * (((float*)output' + str(i) + ')[i]);\n') 
-        main_func_body += ('}\n')
-        main_func_body += ('printf("- K/' + str(i) + ' = %.10e\\n", ans);\n')
-
-    main_func_body += ('printf("- TPR = %.6e\\n", sec);\n')
-
-    template = """
-#include <iostream>
-#include <vector>
-#include <chrono>
-#include <cassert>
-#include <sys/resource.h>
-#include "threadpool.h"
-
 
-{kernel_func}
-
-int main()
-{{
-{main_func_body}
-
-return 0;
-}}
-
-""" 
-    context = {
-      "kernel_func": kernel_code, 
-      "main_func_body": main_func_body
-    }
-
-    with open('main.cpp','w') as file:
-        file.write(template.format(**context))
-    
-    return True, rank
-
-def build_source_file():
+    # Uniform entry for the resident harness, which cannot know the signature of kernel_main.
+    arg_types = input_types + output_types
+    entry_func = 'extern "C" void antares_entry(void **args, int __rank__) {\n'
+    entry_func += '    kernel_main(' + ''.join(['reinterpret_cast<{}*>(args[{}]), '.format(arg_types[i], i) for i in range(len(arg_types))]) + '__rank__);\n'
+    entry_func += '}\n'
+
+    # The tuner config is only a comment, drop it so equivalent kernels share one cache entry.
+    kernel_code = '\n'.join([x for x in kernel_code.split('\n') if not x.startswith('// CONFIG: ')])
+
+    # The header lines travel inside the library, so that libantares_cpu can load it on its own.
+    metadata = '\n'.join([x.strip() for x in kernel_code.split('\n') if x.strip().startswith(('///', '// ['))])
+    entry_func += 'extern "C" const char antares_metadata[] = R"antares(' + metadata + '\n)antares";\n'
+    return True, rank, kernel_code + '\n\n' + entry_func
+
+def split_cpus():
+    # CPU_COMPILE_CPUS=<n> moves g++ to the last n CPUs of this process, rounded up to whole
+    # cores, and leaves the others to the harness, whose ranks are only placed on CPUs they
+    # are allowed to run on (see cpu_topology.h). CPU_THREADS should not exceed the latter.
+    count = int(os.environ.get('CPU_COMPILE_CPUS', '0'))
+    if count <= 0 or not hasattr(os, 'sched_getaffinity'):
+        return None, None
+    cores = {}
+    for cpu in sorted(os.sched_getaffinity(0)):
+        try:
+            with open('/sys/devices/system/cpu/cpu%d/topology/physical_package_id' % cpu) as fp:
+                package = fp.read().strip()
+            with open('/sys/devices/system/cpu/cpu%d/topology/core_id' % cpu) as fp:
+                core = (package, fp.read().strip())
+        except OSError:
+            core = ('', str(cpu))
+        cores.setdefault(core, []).append(cpu)
+    compile_cpus = set()
+    for siblings in reversed(list(cores.values())):
+        if len(compile_cpus) >= count:
+            break
+        compile_cpus.update(siblings)
+    measure_cpus = set(sum(cores.values(), [])) - compile_cpus
+    if not measure_cpus:
+        logging.info('CPU_COMPILE_CPUS=%d leaves no CPU to measure on, compiles pause during measurements instead.', count)
+        return None, None
+    return compile_cpus, measure_cpus
+
+class CpuGate(object):
+    """Without CPUs of their own, compiles run side by side but never while a kernel is
+    measured: a measurement waits for running compiles and holds back new ones."""
+
+    def __init__(self, enabled):
+        self.enabled = enabled
+        self.compiles, self.busy = 0, False
+        self.cond = threading.Condition()
+
+    @contextlib.contextmanager
+    def compiling(self):
+        if not self.enabled:
+            yield
+            return
+        with self.cond:
+            self.cond.wait_for(lambda: not self.busy)
+            self.compiles += 1
+        try:
+            yield
+        finally:
+            with self.cond:
+                self.compiles -= 1
+                self.cond.notify_all()
+
+    @contextlib.contextmanager
+    def measuring(self):
+        # measurements are serialized by measure_lock already
+        if not self.enabled:
+            yield
+            return
+        with self.cond:
+            self.busy = True
+            self.cond.wait_for(lambda: self.compiles == 0)
+        try:
+            yield
+        finally:
+            with self.cond:
+                self.busy = False
+                self.cond.notify_all()
+
+compile_cpus, measure_cpus = split_cpus()
+cpu_gate = CpuGate(compile_cpus is None)
+
+kernel_build_flags = ['-std=c++11', '-O3', '-march=native', '-shared', '-fPIC', '-fno-gnu-unique']
+
+def build_kernel_file(kernel_path, library_path):
     try:
         if platform.system() == 'Linux':
-            cmd = ['timeout', '30s', 'g++', 'main.cpp', '-omain', '-std=c++11', '-lpthread', '-O3', '-march=native']
-            output = subprocess.check_output(cmd)
+            cmd = ['timeout', '30s', 'g++', kernel_path, '-o' + library_path] + kernel_build_flags
+            with cpu_gate.compiling():
+                output = subprocess.check_output(cmd, preexec_fn=(lambda: os.sched_setaffinity(0, compile_cpus)) if compile_cpus else None)
         else:
-            pass
-    except CalledProcessError as e:
+            return False
+    except subprocess.CalledProcessError as e:
         print(e)
         return False
 
     return True
 
-def execute(rank):
-    mask = ""
-    for i in range(rank):
-        mask += "1"
-    cmd = ["taskset", str(hex(int(mask, 2))), "./main"]
-    # logging.info("Starting execute: '%s'", ' '.join(cmd))
-    output = b''
-    try:
-        output = subprocess.check_output(cmd, timeout=10)
-    except subprocess.CalledProcessError as e:
-        print(e)
-
-    return output
-
-
-def profile_kernel(kernel_source):
-    ret, rank = generate_source_file(kernel_source)
+class ResidentHarness(object):
+    """The benchmark process, compiled once and kept alive across kernels."""
+
+    source_files = ['harness.cpp', 'antares_cpu.cpp', 'antares_cpu.h', 'threadpool.h', 'thread_team.h', 'cpu_topology.h', 'perf_counters.h']
+
+    def __init__(self):
+        self.proc = None
+        self.binary = os.path.join(agent_dir, 'harness')
+
+    def build(self):
+        binary_time = os.path.getmtime(self.binary) if os.path.exists(self.binary) else -1
+        if all(os.path.getmtime(os.path.join(agent_dir, x)) < binary_time for x in self.source_files):
+            return
+        cmd = ['g++', os.path.join(agent_dir, 'harness.cpp'), os.path.join(agent_dir, 'antares_cpu.cpp'), '-o' + self.binary + '.tmp', '-std=c++11', '-lpthread', '-ldl', '-O3', '-march=native']
+        subprocess.check_output(cmd)
+        os.rename(self.binary + '.tmp', self.binary)
+
+    def start(self):
+        if self.proc is not None and self.proc.poll() is None:
+            return
+        self.build()
+        self.proc = subprocess.Popen([self.binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE, cwd=agent_dir,
+                                     preexec_fn=(lambda: os.sched_setaffinity(0, measure_cpus)) if measure_cpus else None)
+
+    def stop(self):
+        if self.proc is not None:
+            self.proc.kill()
+            self.proc.wait()
+            self.proc = None
+
+    def run(self, library_path, kernel_path, options={}, timeout=10):
+        self.start()
+        request = ' '.join([library_path, kernel_path] + ['%s=%s' % (k, options[k]) for k in options]) + '\n'
+        output, deadline = b'', time.time() + timeout
+        try:
+            self.proc.stdin.write(request.encode())
+            self.proc.stdin.flush()
+            while not output.endswith(b'[DONE]\n'):
+                remaining = deadline - time.time()
+                if remaining <= 0 or not select.select([self.proc.stdout], [], [], remaining)[0]:
+                    raise Exception('Time limit exceeded for this evaluation.')
+                chunk = os.read(self.proc.stdout.fileno(), 4096)
+                if not chunk:
+                    raise Exception('Benchmark process exited unexpectedly.')
+                output += chunk
+        except Exception as e:
+            # a hung or crashed kernel takes the process down with it, restart on next request
+            logging.info('Harness failure: %s', e)
+            self.stop()
+            return output
+        return output[:-len(b'[DONE]\n')]
+
+class CompileCache(object):
+    """Kernel libraries keyed by a hash of kernel text, build flags and the resolved target,
+    evicted in least-recently-used order once the directory exceeds its size limit.
+    An entry is held from lookup or insert until its measurement ends and is never evicted
+    while held, the .cc and .so files of an entry are always removed together."""
+
+    def __init__(self, cache_dir, size_limit):
+        self.cache_dir = cache_dir
+        self.size_limit = size_limit
+        self.target = None
+        self.hits, self.misses = 0, 0
+        self.holds = {}
+        self.lock = threading.Lock()
+
+    def target_signature(self):
+        # -march=native means different things on different hosts
+        if self.target is None:
+            try:
+                version = subprocess.check_output(['g++', '-dumpfullversion']).decode().strip()
+                options = subprocess.check_output(['g++', '-march=native', '-Q', '--help=target']).decode().split('\n')
+                options = [' '.join(x.split()) for x in options if x.strip().startswith(('-march=', '-mtune='))]
+                self.target = ';'.join([version] + options)
+            except (OSError, subprocess.CalledProcessError):
+                self.target = platform.machine()
+        return self.target
+
+    def digest(self, kernel_code, flags):
+        key = '\0'.join([kernel_code, ' '.join(flags), self.target_signature()])
+        return hashlib.sha256(key.encode()).hexdigest()
+
+    def paths(self, digest):
+        return os.path.join(self.cache_dir, digest + '.cc'), os.path.join(self.cache_dir, digest + '.so')
+
+    def lookup(self, digest):
+        # holds the entry on a hit, see release()
+        kernel_path, library_path = self.paths(digest)
+        with self.lock:
+            if not os.path.exists(kernel_path) or not os.path.exists(library_path):
+                self.misses += 1
+                return False
+            try:
+                os.utime(kernel_path)
+                os.utime(library_path)
+            except OSError:
+                pass
+            self.hits += 1
+            self.holds[digest] = self.holds.get(digest, 0) + 1
+            return True
+
+    def release(self, digest):
+        with self.lock:
+            self.holds[digest] -= 1
+            if self.holds[digest] == 0:
+                del self.holds[digest]
+
+    def insert(self, digest, kernel_code):
+        # build in a private job directory, then publish both files with atomic renames,
+        # holds the entry on success, see release()
+        os.makedirs(self.cache_dir, exist_ok=True)
+        kernel_path, library_path = self.paths(digest)
+        job_dir = tempfile.mkdtemp(prefix='job_', dir=self.cache_dir)
+        try:
+            job_kernel, job_library = os.path.join(job_dir, 'kernel.cc'), os.path.join(job_dir, 'kernel.so')
+            with open(job_kernel, 'w') as file:
+                file.write(kernel_code)
+            if not build_kernel_file(job_kernel, job_library):
+                return False
+            with self.lock:
+                os.replace(job_kernel, kernel_path)
+                os.replace(job_library, library_path)
+                self.holds[digest] = self.holds.get(digest, 0) + 1
+                self.evict()
+        finally:
+            shutil.rmtree(job_dir, ignore_errors=True)
+        return True
+
+    def evict(self):
+        # entries are (last use, bytes, files) by digest, held ones count but are kept
+        entries = {}
+        for name in os.listdir(self.cache_dir):
+            path = os.path.join(self.cache_dir, name)
+            try:
+                stat = os.stat(path)
+            except OSError:
+                continue
+            if not os.path.isdir(path):
+                mtime, size, files = entries.get(os.path.splitext(name)[0], (0, 0, []))
+                entries[os.path.splitext(name)[0]] = (max(mtime, stat.st_mtime), size + stat.st_size, files + [path])
+        total = sum([x[1] for x in entries.values()])
+        for mtime, size, files in sorted([entries[x] for x in entries if x not in self.holds]):
+            if total <= self.size_limit:
+                break
+            # the library goes first, so that a lookup never finds it without its source
+            for path in sorted(files, key=lambda x: not x.endswith('.so')):
+                try:
+                    os.remove(path)
+                except OSError:
+                    pass
+            total -= size
+
+    def report(self):
+        with self.lock:
+            return '- CACHE_HITS = %d\n- CACHE_MISSES = %d\n' % (self.hits, self.misses)
+
+harness = ResidentHarness()
+atexit.register(harness.stop)
+compile_cache = CompileCache(os.environ.get('CPU_CACHE_DIR', os.path.join(os.environ.get('ANTARES_DRIVER_PATH', '/tmp/libAntares'), 'mcpu_cache')),
+                             int(os.environ.get('CPU_CACHE_SIZE', '256')) << 20)
+
+# Kernels compile concurrently, but only one of them is measured at a time, see CpuGate.
+compile_executor = ThreadPoolExecutor(max_workers=int(os.environ.get('CPU_COMPILE_JOBS', str(len(compile_cpus) if compile_cpus else max(1, (os.cpu_count() or 2) // 2)))))
+measure_executor = ThreadPoolExecutor(max_workers=1)
+measure_lock = threading.Lock()
+
+def prepare_kernel(kernel_source):
+    ret, rank, kernel_code = generate_kernel_code(kernel_source)
     if ret == False:
         return False, 'parse kernel failed.'
 
-    ret = build_source_file()
+    # a prepared kernel stays held in the cache until measure_kernel() is done with it
+    digest = compile_cache.digest(kernel_code, kernel_build_flags)
+    if not compile_cache.lookup(digest):
+        ret = compile_cache.insert(digest, kernel_code)
+        if ret == False:
+            return False, 'build kernel failed.'
+    return True, digest
+
+def measure_kernel(digest, options={}):
+    kernel_path, library_path = compile_cache.paths(digest)
+    try:
+        with measure_lock, cpu_gate.measuring():
+            output = harness.run(library_path, kernel_path, options)
+    finally:
+        compile_cache.release(digest)
+    return output.decode('utf-8') + compile_cache.report()
+
+def profile_kernel(kernel_source, options={}):
+    ret, result = prepare_kernel(kernel_source)
     if ret == False:
-        return False, 'build kernel failed.'
+        return False, result
+    return True, measure_kernel(result, options)
 
-    output = execute(rank)
-    return True, output.decode('utf-8')
+def split_kernels(content):
+    # every kernel starts with its `///` property line
+    return [x for x in re.split(r'(?m)^(?=///)', content) if x.strip()]
 
 @tornado.web.stream_request_body
 class PUTHandler(tornado.web.RequestHandler):
+    """Accepts one or more concatenated kernels. Results stream back as soon as each kernel
+    is measured, every block starting with a `[KERNEL i]` line (i = position in the request).
+    Headers `X-Antares-<KEY>: <VAL>` are forwarded to the harness as options."""
+
     def initialize(self):
         self.bytes_read = 0
         
@@ -267,13 +415,32 @@ class PUTHandler(tornado.web.RequestHandler):
         self.bytes_read += len(chunk)
         self.content.append(chunk.decode('utf-8'))
 
-    def put(self, filename):
+    def get_options(self):
+        options = {}
+        for key, val in self.request.headers.get_all():
+            if key.lower().startswith('x-antares-'):
+                options[key[len('x-antares-'):].upper().replace('-', '_')] = val.strip()
+        return options
+
+    async def evaluate(self, index, kernel_source, options):
+        ioloop = tornado.ioloop.IOLoop.current()
+        ret, result = await ioloop.run_in_executor(compile_executor, prepare_kernel, kernel_source)
+        if ret == False:
+            return index, result + '\n'
+        output = await ioloop.run_in_executor(measure_executor, measure_kernel, result, options)
+        return index, output
+
+    async def put(self, filename):
         mtype = self.request.headers.get("Content-Type")
-        logging.info('PUT "%s" "%s" %d bytes', filename, mtype, self.bytes_read)
-
-        ret, output = profile_kernel(''.join(self.content))
-        
-        self.write(output)
+        kernels = split_kernels(''.join(self.content))
+        options = self.get_options()
+        logging.info('PUT "%s" "%s" %d bytes, %d kernels', filename, mtype, self.bytes_read, len(kernels))
+
+        tasks = [self.evaluate(i, kernels[i], options) for i in range(len(kernels))]
+        for task in asyncio.as_completed(tasks):
+            index, output = await task
+            self.write('[KERNEL %d]\n%s' % (index, output))
+            await self.flush()
         
 
 class POSTHandler(tornado.web.RequestHandler):
@@ -0,0 +1,573 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Resident benchmark process for c-mcpu kernels. It is compiled once by the
+// eval agent and then reads one request per line from stdin:
+//
+//   <kernel.so> <kernel.cc> [KEY=VAL ...]
+//
+// Kernels are loaded and launched through the libantares_cpu runtime
+// (antares_cpu.h), the same code production callers embed. Tensor properties
+// and the rank count come from the kernel header, the kernel runs against
+// buffers that stay allocated across requests, and the result is reported as
+// `- K/i = ..` and `- TPR = ..` lines followed by [DONE]. KEY=VAL options
+// override environment variables of the same name. A kernel may carry the
+// launch options it was tuned with in a `// [launch_options] KEY=VAL ...`
+// line; they apply unless the request sets the same keys.
+//
+// CPU_AFFINITY places the ranks: `compact` fills the SMT siblings of a core
+// first, `scatter` takes one hardware thread of every core first, `numa`
+// splits the ranks into one contiguous block per NUMA node. Without it rank r
+// runs on the r-th CPU allowed to the process.
+//
+// Timing collects samples until CPU_TIME_BUDGET seconds (default 1.0) are
+// spent, or earlier once the 95% confidence interval of the mean is within
+// CPU_TARGET_CI (default 1%) after at least CPU_MIN_SAMPLES samples, or once
+// the candidate is provably slower than EXPECTED_TIMEOUT. TPR is the median
+// after outlier rejection; TPR_MIN/MEDIAN/P90/MEAN/CV, SAMPLES and OUTLIERS
+// are reported as well. IMBALANCE is the busiest rank over the mean busy time
+// of all ranks in one launch; kernels far above 1 are what dynamic chunking
+// (ranks claiming chunks from a counter inside the kernel) is meant for.
+//
+// FLUSH_MEM times every launch with cold caches: `clflush` evicts the tensor
+// buffers line by line, any other non-empty value sweeps a scratch buffer of
+// twice the last level cache on every rank. The flush is not part of TPR.
+//
+// CPU_COUNTERS reads hardware counters of all ranks over the measured region
+// and reports them per launch: CYCLES, INSTRUCTIONS, IPC, L1D_MISSES,
+// LLC_MISSES, BRANCH_MISSES and FP_OPS, whichever the host can count.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "antares_cpu.h"
+#include "perf_counters.h"
+
+// float16 (binary16) and bfloat16 tensors are filled and digested through float.
+static float half_to_float(uint16_t h) {
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = uint32_t(h & 0x8000) << 16, exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff, bits;
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else {
+        // subnormal, normalize it
+        exponent = 113;
+        while (!(mantissa & 0x400))
+            mantissa <<= 1, --exponent;
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+#endif
+}
+
+// exact for the small integers the inputs are filled with
+static uint16_t float_to_half(float f) {
+#if defined(__F16C__)
+    return _cvtss_sh(f, 0);
+#else
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xff) - 112;
+    if (exponent <= 0)
+        return sign;
+    if (exponent >= 0x1f)
+        return sign | 0x7c00;
+    return sign | (exponent << 10) | ((bits >> 13) & 0x3ff);
+#endif
+}
+
+static float bfloat16_to_float(uint16_t h) {
+    uint32_t bits = uint32_t(h) << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint16_t float_to_bfloat16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return uint16_t((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+// Tensor buffers are kept across requests and only grow, so consecutive
+// candidates of one tuning job never reallocate. Memory is mapped directly,
+// so it is page aligned and stays untouched until the ranks initialize it:
+// each rank first touches its own slice, which puts the pages on the NUMA
+// node of that rank. A buffer is mapped again when the rank count, the
+// placement policy or the launch mode changes, so the page placement always
+// matches the current team.
+//
+// CPU_HUGE_PAGES=thp asks for transparent huge pages with madvise, `hugetlb`
+// tries MAP_HUGETLB first and falls back to THP when no pages are reserved.
+class buffer_arena {
+public:
+    static const size_t huge_page_size = 2LU << 20;
+
+    void configure(const std::string &mode) {
+        if (mode == page_mode)
+            return;
+        release();
+        page_mode = mode;
+    }
+
+    // `owners` names the ranks that first touch the buffer and where they run
+    void *get(size_t slot, size_t bytes, const std::string &owners) {
+        if (slot >= blocks.size())
+            blocks.resize(slot + 1);
+        block &b = blocks[slot];
+        if (b.capacity < bytes || b.owners != owners) {
+            unmap(b);
+            map(b, bytes);
+            b.owners = owners;
+        }
+        return b.ptr;
+    }
+
+    ~buffer_arena() {
+        release();
+    }
+
+private:
+    struct block {
+        void *base = nullptr, *ptr = nullptr;
+        size_t length = 0, capacity = 0;
+        std::string owners;
+    };
+
+    void map(block &b, size_t bytes) {
+        const int prot = PROT_READ | PROT_WRITE, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        bytes = std::max(bytes, size_t(1));
+        if (page_mode == "hugetlb") {
+            size_t length = (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+            void *ptr = mmap(nullptr, length, prot, flags | MAP_HUGETLB, -1, 0);
+            if (ptr != MAP_FAILED) {
+                b.base = b.ptr = ptr, b.length = b.capacity = length;
+                return;
+            }
+        }
+        if (page_mode.empty()) {
+            size_t length = (bytes + page_size - 1) & ~(page_size - 1);
+            void *ptr = mmap(nullptr, length, prot, flags, -1, 0);
+            if (ptr == MAP_FAILED)
+                throw std::runtime_error("Failed to allocate tensor memory.");
+            b.base = b.ptr = ptr, b.length = b.capacity = length;
+            return;
+        }
+        // over-allocate by one huge page so the buffer can start on a huge page boundary
+        size_t capacity = (bytes + huge_page_size - 1) & ~(huge_page_size - 1), length = capacity + huge_page_size;
+        void *ptr = mmap(nullptr, length, prot, flags, -1, 0);
+        if (ptr == MAP_FAILED)
+            throw std::runtime_error("Failed to allocate tensor memory.");
+        b.base = ptr, b.length = length, b.capacity = capacity;
+        b.ptr = (void *)(((size_t)ptr + huge_page_size - 1) & ~(huge_page_size - 1));
+#ifdef MADV_HUGEPAGE
+        madvise(b.ptr, capacity, MADV_HUGEPAGE);
+#endif
+    }
+
+    void unmap(block &b) {
+        if (b.base)
+            munmap(b.base, b.length);
+        b = block();
+    }
+
+    void release() {
+        for (auto &it: blocks)
+            unmap(it);
+        blocks.clear();
+    }
+
+    std::string page_mode;
+    std::vector<block> blocks;
+};
+
+static void check(int ret) {
+    if (ret != 0)
+        throw std::runtime_error(antares_cpu_last_error());
+}
+
+// Host-side work on the ranks of a loaded kernel, on the threads it launches on.
+struct kernel_team {
+    antares_cpu_kernel *kernel;
+
+    template<class F>
+    void run(F&& fn) {
+        typedef typename std::remove_reference<F>::type function_type;
+        check(antares_cpu_parallel(kernel, [](void *f, int rank) { (*static_cast<function_type *>(f))(rank); }, (void *)&fn));
+    }
+};
+
+// Linear interpolation between closest ranks, `sorted` must not be empty.
+double percentile(const std::vector<double> &sorted, double q) {
+    double pos = q * (sorted.size() - 1);
+    size_t lo = size_t(pos), hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (sorted[hi] - sorted[lo]) * (pos - lo);
+}
+
+struct timing_stats {
+    size_t samples, outliers;
+    double min, median, p90, mean, cv;
+
+    // relative half width of the 95% confidence interval of the mean
+    double ci() const {
+        return samples > 1 ? 1.96 * cv / std::sqrt(double(samples)) : INFINITY;
+    }
+};
+
+// Samples outside Tukey's fences (1.5 IQR beyond the quartiles) are dropped
+// before anything else is computed, they are mostly preemptions and page faults.
+timing_stats summarize(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    double q1 = percentile(samples, 0.25), q3 = percentile(samples, 0.75), fence = 1.5 * (q3 - q1);
+    std::vector<double> kept;
+    for (auto it: samples)
+        if (it >= q1 - fence && it <= q3 + fence)
+            kept.push_back(it);
+
+    timing_stats stats;
+    stats.samples = kept.size();
+    stats.outliers = samples.size() - kept.size();
+    stats.min = kept.front();
+    stats.median = percentile(kept, 0.5);
+    stats.p90 = percentile(kept, 0.9);
+    stats.mean = std::accumulate(kept.begin(), kept.end(), 0.0) / kept.size();
+    double var = 0.0;
+    for (auto it: kept)
+        var += (it - stats.mean) * (it - stats.mean);
+    var = kept.size() > 1 ? var / (kept.size() - 1) : 0.0;
+    stats.cv = stats.mean > 0 ? std::sqrt(var) / stats.mean : 0.0;
+    return stats;
+}
+
+// Evicts the tensors from every cache level between two timed launches.
+class cache_flusher {
+public:
+    cache_flusher() : scratch(nullptr), scratch_size(0) {}
+
+    // sizes in bytes from sysconf, falling back to sysfs and then to a generous guess
+    static size_t cache_size(int level) {
+        long size = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+        if (level == 2)
+            size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        else if (level == 3)
+            size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+        if (size > 0)
+            return size;
+        std::ifstream t("/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(level) + "/size");
+        std::string text;
+        if (t >> text && text.size() > 0) {
+            size = std::atol(text.c_str());
+            if (text.back() == 'K') size <<= 10;
+            if (text.back() == 'M') size <<= 20;
+            if (size > 0)
+                return size;
+        }
+        return level == 2 ? (2LU << 20) : (64LU << 20);
+    }
+
+    // the sweep is split across the ranks, so that private caches of every core are replaced as well
+    template<class L>
+    void sweep(L &team, int ranks) {
+        size_t slice = std::max(2 * cache_size(2), std::min(size_t(512) << 20, 2 * cache_size(3)) / ranks);
+        slice = (slice + 63) & ~size_t(63);
+        if (scratch_size < slice * ranks) {
+            free(scratch);
+            scratch = nullptr, scratch_size = 0;
+            if (posix_memalign((void **)&scratch, 64, slice * ranks) != 0)
+                throw std::runtime_error("Failed to allocate cache flush buffer.");
+            scratch_size = slice * ranks;
+            memset(scratch, 0, scratch_size);
+        }
+        char *base = scratch;
+        team.run([=](int rank) {
+            // writing each line also forces the dirty output lines out
+            volatile char *ptr = base + slice * rank;
+            for (size_t i = 0; i < slice; i += 64)
+                ptr[i] = ptr[i] + 1;
+        });
+    }
+
+    static void flush_lines(const void *ptr, size_t bytes) {
+#if defined(__x86_64__) || defined(__i386__)
+        const char *p = (const char *)(size_t(ptr) & ~size_t(63)), *end = (const char *)ptr + bytes;
+        for (; p < end; p += 64) {
+#ifdef __CLFLUSHOPT__
+            _mm_clflushopt((void *)p);
+#else
+            _mm_clflush(p);
+#endif
+        }
+        _mm_mfence();
+#endif
+    }
+
+    ~cache_flusher() {
+        free(scratch);
+    }
+
+private:
+    char *scratch;
+    size_t scratch_size;
+};
+
+typedef std::map<std::string, std::string> options_t;
+
+std::string get_option(const antares_cpu_kernel *kernel, const std::string &key, const std::string &def_val = "") {
+    const char *value = antares_cpu_option(kernel, key.c_str());
+    return value ? value : def_val;
+}
+
+static buffer_arena arena;
+static antares_cpu_runtime *runtime = antares_cpu_create();
+static cache_flusher flusher;
+static PerfCounters counters;
+
+void evaluate(const std::string &library_path, const std::string &source_path, const options_t &request_options) {
+    std::string encoded;
+    for (auto &it: request_options)
+        encoded += it.first + "=" + it.second + " ";
+    std::unique_ptr<antares_cpu_kernel, void (*)(antares_cpu_kernel *)> kernel(
+        antares_cpu_load(runtime, library_path.c_str(), source_path.c_str(), encoded.c_str()), antares_cpu_unload);
+    if (!kernel)
+        throw std::runtime_error(antares_cpu_last_error());
+    int ranks = antares_cpu_num_ranks(kernel.get()), num_inputs = antares_cpu_num_inputs(kernel.get());
+    int num_outputs = antares_cpu_num_outputs(kernel.get());
+    kernel_team team = {kernel.get()};
+
+    std::string page_mode = get_option(kernel.get(), "CPU_HUGE_PAGES");
+    arena.configure(page_mode == "0" ? "" : page_mode);
+
+    std::string owners = std::to_string(ranks) + " " + get_option(kernel.get(), "CPU_AFFINITY") + " " + get_option(kernel.get(), "CPU_LAUNCH");
+    std::vector<void*> args;
+    std::vector<size_t> arg_bytes;
+    std::vector<std::string> arg_dtypes;
+    for (int i = 0; i < num_inputs + num_outputs; ++i) {
+        const antares_cpu_tensor *info = antares_cpu_tensor_info(kernel.get(), i);
+        arg_bytes.push_back(info->bytes);
+        arg_dtypes.push_back(info->dtype);
+        args.push_back(arena.get(i, arg_bytes[i], owners));
+        check(antares_cpu_bind(kernel.get(), i, args[i]));
+    }
+
+    // every rank initializes, and so first touches, its own page aligned slice of each tensor
+    team.run([&](int rank) {
+        for (size_t i = 0; i < args.size(); ++i) {
+            size_t chunk = ((arg_bytes[i] + ranks - 1) / ranks + 4095) & ~size_t(4095);
+            size_t begin = std::min(arg_bytes[i], chunk * rank), end = std::min(arg_bytes[i], begin + chunk);
+            if (i >= size_t(num_inputs)) {
+                memset((char*)args[i] + begin, 0, end - begin);
+            } else if (arg_dtypes[i] == "float32") {
+                for (size_t x = begin / sizeof(float); x < end / sizeof(float); ++x)
+                    ((float*)args[i])[x] = (x + i + 1) % 71;
+            } else if (arg_dtypes[i] == "float16" || arg_dtypes[i] == "bfloat16") {
+                auto convert = arg_dtypes[i] == "float16" ? float_to_half : float_to_bfloat16;
+                for (size_t x = begin / sizeof(uint16_t); x < end / sizeof(uint16_t); ++x)
+                    ((uint16_t*)args[i])[x] = convert((x + i + 1) % 71);
+            } else {
+                for (size_t x = begin / sizeof(int); x < end / sizeof(int); ++x)
+                    ((int*)args[i])[x] = (x + i + 1) % 71;
+            }
+        }
+    });
+
+    std::string counter_mode = get_option(kernel.get(), "CPU_COUNTERS");
+    bool use_counters = !counter_mode.empty() && counter_mode != "0";
+    counters.reset();
+    if (use_counters)
+        antares_cpu_set_rank_hook(runtime, [](void *ctx, int) { static_cast<PerfCounters *>(ctx)->attach(); }, &counters);
+    else
+        antares_cpu_set_rank_hook(runtime, nullptr, nullptr);
+
+    auto launch = [&]() {
+        check(antares_cpu_launch(kernel.get()));
+    };
+    std::string flush_mode = get_option(kernel.get(), "FLUSH_MEM");
+    if (flush_mode == "0")
+        flush_mode.clear();
+#if !defined(__x86_64__) && !defined(__i386__)
+    if (flush_mode == "clflush")
+        flush_mode = "sweep";
+#endif
+    auto flush = [&]() {
+        if (flush_mode == "clflush") {
+            for (size_t i = 0; i < args.size(); ++i)
+                cache_flusher::flush_lines(args[i], arg_bytes[i]);
+        } else
+            flusher.sweep(team, ranks);
+    };
+
+    auto run = [&](int run_times) -> double {
+        if (!flush_mode.empty()) {
+            // every launch is timed on its own, right after its flush
+            double total = 0.0;
+            for (int i = 0; i < run_times; ++i) {
+                if (use_counters)
+                    counters.disable();
+                flush();
+                if (use_counters)
+                    counters.enable();
+                auto t1 = std::chrono::high_resolution_clock::now();
+                launch();
+                auto t2 = std::chrono::high_resolution_clock::now();
+                total += std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+            }
+            return total / run_times;
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < run_times; ++i)
+            launch();
+        auto t2 = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count() / run_times;
+    };
+
+    double budget = std::atof(get_option(kernel.get(), "CPU_TIME_BUDGET", "1.0").c_str());
+    double target_ci = std::atof(get_option(kernel.get(), "CPU_TARGET_CI", "0.01").c_str());
+    size_t min_samples = std::max(2, std::atoi(get_option(kernel.get(), "CPU_MIN_SAMPLES", "10").c_str()));
+    std::string expected_timeout = get_option(kernel.get(), "EXPECTED_TIMEOUT");
+    double time_limit = (expected_timeout.empty() || expected_timeout == "inf") ? 0.0 : std::atof(expected_timeout.c_str());
+    const size_t max_samples = 100000;
+
+    // Warmup.
+    double sec = run(1);
+
+    // Launches too short for the clock are timed in batches, one sample per batch.
+    int batch = std::max(1, std::min(1000, int(2e-5 / std::max(sec, 1e-9))));
+    if (!flush_mode.empty())
+        batch = 1;
+
+    // the budget is wall time, flushing included
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<double> samples;
+    double min_sample = sec, elapsed = 0.0;
+    size_t next_check = min_samples;
+    timing_stats stats;
+    if (use_counters)
+        counters.start();
+    while (true) {
+        sec = run(batch);
+        samples.push_back(sec);
+        min_sample = std::min(min_sample, sec);
+        elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - start).count();
+
+        // the warmup and a sample both above the limit cannot turn into a winner
+        if (time_limit > 0 && min_sample > time_limit) {
+            char message[128];
+            snprintf(message, sizeof(message), "Time limit exceeded: %g v.s. (expected) %s", min_sample, expected_timeout.c_str());
+            throw std::runtime_error(message);
+        }
+        bool exhausted = samples.size() >= max_samples || (elapsed >= budget && samples.size() >= 3);
+        if (!exhausted && samples.size() < next_check)
+            continue;
+        stats = summarize(samples);
+        if (exhausted || stats.ci() <= target_ci)
+            break;
+        next_check = samples.size() + std::max<size_t>(1, samples.size() / 4);
+    }
+    if (use_counters)
+        counters.disable();
+
+    std::vector<double> busy(ranks);
+    team.run([&](int rank) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        antares_cpu_run_rank(kernel.get(), rank);
+        busy[rank] = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - t1).count();
+    });
+    double busy_mean = std::accumulate(busy.begin(), busy.end(), 0.0) / ranks;
+
+    for (int c = 0; c < num_outputs; ++c) {
+        size_t output_byte_size = arg_bytes[num_inputs + c];
+        const std::string &dtype = arg_dtypes[num_inputs + c];
+        void *ptr = args[num_inputs + c];
+        double digest = 0.0;
+        if (dtype == "int32") {
+            for (size_t i = 0; i < output_byte_size / sizeof(int); ++i)
+                digest += (i + 1) % 83 * ((int*)ptr)[i];
+        } else if (dtype == "float16" || dtype == "bfloat16") {
+            auto convert = dtype == "float16" ? half_to_float : bfloat16_to_float;
+            for (size_t i = 0; i < output_byte_size / sizeof(uint16_t); ++i)
+                digest += (i + 1) % 83 * convert(((uint16_t*)ptr)[i]);
+        } else {
+            for (size_t i = 0; i < output_byte_size / sizeof(float); ++i)
+                digest += (i + 1) % 83 * ((float*)ptr)[i];
+        }
+        printf("- K/%d = %.10e\n", c, digest);
+    }
+    printf("- TPR = %.6e\n", stats.median);
+    printf("- TPR_MIN = %.6e\n", stats.min);
+    printf("- TPR_MEDIAN = %.6e\n", stats.median);
+    printf("- TPR_P90 = %.6e\n", stats.p90);
+    printf("- TPR_MEAN = %.6e\n", stats.mean);
+    printf("- TPR_CV = %.6e\n", stats.cv);
+    printf("- SAMPLES = %zu\n", samples.size());
+    printf("- OUTLIERS = %zu\n", stats.outliers);
+    if (busy_mean > 0)
+        printf("- IMBALANCE = %.4f\n", *std::max_element(busy.begin(), busy.end()) / busy_mean);
+
+    if (use_counters) {
+        double values[PerfCounters::NUM_COUNTERS];
+        bool available[PerfCounters::NUM_COUNTERS];
+        counters.read(values, available);
+        double launches = double(samples.size()) * batch;
+        for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i)
+            if (available[i])
+                printf("- %s = %.6e\n", PerfCounters::name(i), values[i] / launches);
+        if (available[PerfCounters::CYCLES] && available[PerfCounters::INSTRUCTIONS] && values[PerfCounters::CYCLES] > 0)
+            printf("- IPC = %.4f\n", values[PerfCounters::INSTRUCTIONS] / values[PerfCounters::CYCLES]);
+    }
+}
+
+int main()
+{
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::istringstream request(line);
+        std::string library_path, source_path, item;
+        if (!(request >> library_path >> source_path))
+            continue;
+        options_t options;
+        while (request >> item) {
+            auto at = item.find('=');
+            if (at != std::string::npos)
+                options[item.substr(0, at)] = item.substr(at + 1);
+        }
+        try {
+            evaluate(library_path, source_path, options);
+        } catch (std::exception &e) {
+            printf("[ERROR] %s\n", e.what());
+        }
+        printf("[DONE]\n");
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Hardware counters of every thread that runs a rank. Each such thread calls
+// attach() from inside the kernel launch, which opens its counter groups for
+// the calling thread (pid = 0); the measuring thread then enables, disables
+// and reads all of them. Counters that the PMU cannot schedule at the same
+// time are multiplexed and scaled by time_enabled / time_running.
+class PerfCounters {
+public:
+    enum { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, FP_OPS, NUM_COUNTERS };
+
+    static const char *name(int id) {
+        static const char *names[NUM_COUNTERS] = {"CYCLES", "INSTRUCTIONS", "L1D_MISSES", "LLC_MISSES", "BRANCH_MISSES", "FP_OPS"};
+        return names[id];
+    }
+
+    PerfCounters() : wanted(), opened(), generation(1), running(false) {}
+
+    // opens the groups of the calling thread once per generation
+    void attach();
+    // closes every group, threads attach again on their next launch
+    void reset();
+    // zero all counters and start counting
+    void start();
+    void enable();
+    void disable();
+    // sums over threads; a counter is available only if every thread could open it
+    void read(double values[NUM_COUNTERS], bool available[NUM_COUNTERS]);
+
+    ~PerfCounters() { reset(); }
+
+private:
+    struct event_spec {
+        int id;
+        uint32_t type;
+        uint64_t config;
+        double weight;
+    };
+
+    struct group {
+        int leader;
+        std::vector<int> fds, ids;
+        std::vector<double> weights;
+    };
+
+    static int open_event(const event_spec &spec, int group_fd, bool disabled);
+    static std::vector<event_spec> fp_events();
+    void control(unsigned long request);
+
+    std::vector<group> groups;
+    // events asked for and events actually opened, over all threads
+    int wanted[NUM_COUNTERS], opened[NUM_COUNTERS];
+    std::atomic<uint64_t> generation;
+    bool running;
+    std::mutex mutex;
+};
+
+inline int PerfCounters::open_event(const event_spec &spec, int group_fd, bool disabled)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = spec.type;
+    attr.config = spec.config;
+    attr.disabled = disabled;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+// There is no generic FP event, use the vendor's raw encoding. Intel counts
+// retired FP instructions per vector width (FP_ARITH_INST_RETIRED), weighted
+// by their lanes here; AMD Zen counts retired FLOPs directly.
+inline std::vector<PerfCounters::event_spec> PerfCounters::fp_events()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line, vendor;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 9, "vendor_id") == 0) {
+            vendor = line.substr(line.find(':') + 1);
+            break;
+        }
+    }
+    std::vector<event_spec> events;
+    if (vendor.find("GenuineIntel") != std::string::npos) {
+        const uint64_t umasks[] = {0x03, 0x04, 0x18, 0x60, 0x80};
+        const double lanes[] = {1, 2, 4, 8, 16};
+        for (int i = 0; i < 5; ++i)
+            events.push_back(event_spec{FP_OPS, PERF_TYPE_RAW, (umasks[i] << 8) | 0xC7, lanes[i]});
+    } else if (vendor.find("AuthenticAMD") != std::string::npos) {
+        events.push_back(event_spec{FP_OPS, PERF_TYPE_RAW, (0xFFLU << 8) | 0x03, 1});
+    }
+    return events;
+}
+
+inline void PerfCounters::attach()
+{
+    static thread_local uint64_t attached = 0;
+    if (attached == generation.load(std::memory_order_relaxed))
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    attached = generation.load(std::memory_order_relaxed);
+
+    const uint64_t cache_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    std::vector<event_spec> core = {
+        {CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1},
+        {INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 1},
+        {L1D_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cache_miss, 1},
+        {LLC_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | cache_miss, 1},
+        {BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1},
+    };
+    // one group for the core events, every FP event on its own since they rarely fit together
+    std::vector< std::vector<event_spec> > layout = {core};
+    for (auto &it: fp_events())
+        layout.push_back({it});
+    for (auto &specs: layout) {
+        for (auto &spec: specs)
+            ++wanted[spec.id];
+        group g;
+        g.leader = -1;
+        for (auto &spec: specs) {
+            int fd = open_event(spec, g.leader, g.leader < 0 && !running);
+            if (fd < 0) {
+                // without a leader the rest of the group cannot be opened either
+                if (g.leader < 0)
+                    break;
+                continue;
+            }
+            if (g.leader < 0)
+                g.leader = fd;
+            g.fds.push_back(fd);
+            g.ids.push_back(spec.id);
+            g.weights.push_back(spec.weight);
+        }
+        if (g.leader < 0)
+            continue;
+        for (auto id: g.ids)
+            ++opened[id];
+        groups.push_back(g);
+    }
+}
+
+inline void PerfCounters::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &g: groups)
+        for (auto fd: g.fds)
+            close(fd);
+    groups.clear();
+    memset(wanted, 0, sizeof(wanted));
+    memset(opened, 0, sizeof(opened));
+    running = false;
+    ++generation;
+}
+
+inline void PerfCounters::control(unsigned long request)
+{
+    for (auto &g: groups)
+        ioctl(g.leader, request, PERF_IOC_FLAG_GROUP);
+}
+
+inline void PerfCounters::start()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    control(PERF_EVENT_IOC_RESET);
+    control(PERF_EVENT_IOC_ENABLE);
+    running = true;
+}
+
+inline void PerfCounters::enable()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    control(PERF_EVENT_IOC_ENABLE);
+    running = true;
+}
+
+inline void PerfCounters::disable()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    control(PERF_EVENT_IOC_DISABLE);
+    running = false;
+}
+
+inline void PerfCounters::read(double values[NUM_COUNTERS], bool available[NUM_COUNTERS])
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+        values[i] = 0.0;
+    for (auto &g: groups) {
+        // nr, time_enabled, time_running, then one value per member
+        std::vector<uint64_t> data(3 + g.fds.size());
+        if (::read(g.leader, data.data(), data.size() * sizeof(uint64_t)) < (ssize_t)(3 * sizeof(uint64_t)))
+            continue;
+        double scale = data[2] ? double(data[1]) / data[2] : 0.0;
+        for (size_t i = 0; i < g.fds.size() && i < data[0]; ++i)
+            values[g.ids[i]] += data[3 + i] * scale * g.weights[i];
+    }
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+        available[i] = wanted[i] > 0 && opened[i] == wanted[i];
+}
+
+#endif
@@ -0,0 +1,179 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef THREAD_TEAM_H
+#define THREAD_TEAM_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <sched.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THREAD_TEAM_RELAX() _mm_pause()
+#else
+#define THREAD_TEAM_RELAX() std::this_thread::yield()
+#endif
+
+// Sense-reversing barrier: the last thread to arrive resets the counter and
+// flips the global sense, everyone else waits for the flip.
+class SpinBarrier {
+public:
+    explicit SpinBarrier(int count)
+        :   count(count), remaining(count), sense(false) {}
+
+    // returns the sense to wait for, so arrival and waiting can be split
+    bool arrive(bool &local_sense) {
+        local_sense = !local_sense;
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            remaining.store(count, std::memory_order_relaxed);
+            sense.store(local_sense, std::memory_order_release);
+        }
+        return local_sense;
+    }
+
+    void wait(bool local_sense) const {
+        for (int spin = 1; sense.load(std::memory_order_acquire) != local_sense; ++spin) {
+            THREAD_TEAM_RELAX();
+            // give the CPU away now and then in case the team is oversubscribed
+            if ((spin & 1023) == 0)
+                std::this_thread::yield();
+        }
+    }
+
+    void arrive_and_wait(bool &local_sense) {
+        wait(arrive(local_sense));
+    }
+
+private:
+    const int count;
+    std::atomic<int> remaining;
+    std::atomic<bool> sense;
+};
+
+// Resident thread team: size - 1 pinned workers stay alive across launches,
+// the calling thread is rank 0.
+// Rank r runs on placement[r], or on the r-th CPU allowed to this process
+// (as set by taskset) when there is no placement.
+// A launch publishes the job and bumps an epoch counter, completion is a
+// single barrier. Workers spin on the epoch for a while after each launch
+// and park on a condition variable afterwards.
+class ThreadTeam {
+public:
+    explicit ThreadTeam(int size, int spin_count = 1 << 20, const std::vector<int> &placement = std::vector<int>());
+    // run fn(rank) once for every rank in [0, size) and wait for completion
+    template<class F>
+    void run(F&& fn);
+    int size() const { return team_size; }
+    ~ThreadTeam();
+private:
+    void worker_loop(int rank);
+    void pin_to(int rank) const;
+
+    const int team_size;
+    const int spin_count;
+    std::vector< std::thread > workers;
+    std::vector< int > cpus;
+
+    // the current job, published by the epoch bump
+    void (*body)(const void *, int);
+    const void *fn;
+    std::atomic<uint64_t> epoch;
+    SpinBarrier done;
+    bool master_sense;
+
+    std::mutex park_mutex;
+    std::condition_variable condition;
+    std::atomic<int> parked;
+    std::atomic<bool> stop;
+};
+
+inline void ThreadTeam::pin_to(int rank) const
+{
+    if (cpus.empty())
+        return;
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    CPU_SET(cpus[rank % cpus.size()], &target);
+    pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+}
+
+inline ThreadTeam::ThreadTeam(int size, int spin_count, const std::vector<int> &placement)
+    :   team_size(size < 1 ? 1 : size), spin_count(spin_count), cpus(placement), body(nullptr), fn(nullptr),
+        epoch(0), done(team_size), master_sense(false), parked(0), stop(false)
+{
+    cpu_set_t allowed;
+    if (cpus.empty() && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+    }
+    for (int rank = 1; rank < team_size; ++rank)
+        workers.emplace_back([this, rank] { this->worker_loop(rank); });
+    pin_to(0);
+}
+
+inline void ThreadTeam::worker_loop(int rank)
+{
+    pin_to(rank);
+    bool local_sense = false;
+    uint64_t seen = 0;
+    for (;;) {
+        uint64_t next;
+        int spin = 0;
+        while ((next = epoch.load(std::memory_order_acquire)) == seen && ++spin < spin_count) {
+            THREAD_TEAM_RELAX();
+            if ((spin & 1023) == 0)
+                std::this_thread::yield();
+        }
+        if (next == seen) {
+            parked.fetch_add(1, std::memory_order_seq_cst);
+            {
+                std::unique_lock<std::mutex> lock(park_mutex);
+                condition.wait(lock, [this, seen] { return epoch.load(std::memory_order_seq_cst) != seen; });
+            }
+            parked.fetch_sub(1, std::memory_order_seq_cst);
+            next = epoch.load(std::memory_order_acquire);
+        }
+        seen = next;
+        if (stop.load(std::memory_order_acquire))
+            return;
+        body(fn, rank);
+        done.arrive(local_sense);
+    }
+}
+
+template<class F>
+void ThreadTeam::run(F&& fn)
+{
+    typedef typename std::remove_reference<F>::type function_type;
+    body = [](const void *f, int rank) { (*static_cast<function_type *>(const_cast<void *>(f)))(rank); };
+    this->fn = &fn;
+
+    epoch.fetch_add(1, std::memory_order_seq_cst);
+    if (parked.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        condition.notify_all();
+    }
+    fn(0);
+    done.arrive_and_wait(master_sense);
+}
+
+inline ThreadTeam::~ThreadTeam()
+{
+    stop.store(true, std::memory_order_release);
+    epoch.fetch_add(1, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        condition.notify_all();
+    }
+    for (std::thread &worker: workers)
+        worker.join();
+}
+
+#endif
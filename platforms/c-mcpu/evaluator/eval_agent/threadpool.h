@@ -5,95 +5,362 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THREAD_POOL_RELAX() _mm_pause()
+#else
+#define THREAD_POOL_RELAX() std::this_thread::yield()
+#endif
+
+// A task is a function pointer plus a few bytes of inline storage, so that
+// dispatching one rank never touches the heap.
+struct PoolTask {
+    static const size_t inline_size = 48;
+
+    void (*invoke)(PoolTask *, int);
+    std::aligned_storage<inline_size, alignof(std::max_align_t)>::type storage;
+
+    template<class T>
+    T *data() {
+        static_assert(sizeof(T) <= inline_size, "task payload exceeds inline storage");
+        static_assert(std::is_trivially_destructible<T>::value, "task payload must be trivially destructible");
+        return reinterpret_cast<T *>(&storage);
+    }
+};
+
+// Chase-Lev work-stealing deque (Le et al., PPoPP'13): the owner pushes and
+// pops at the bottom, thieves take from the top with a single CAS.
+class TaskDeque {
+public:
+    explicit TaskDeque(int64_t capacity = 256)
+        :   top(0), bottom(0)
+    {
+        buffers.emplace_back(new Buffer(capacity));
+        array.store(buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    void push(PoolTask *task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Buffer *a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1)
+            a = grow(a, b, t);
+        a->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    PoolTask *pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        PoolTask *task = a->get(b);
+        if (t == b) {
+            // last element: race against thieves
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                task = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    PoolTask *steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+        Buffer *a = array.load(std::memory_order_acquire);
+        PoolTask *task = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return task;
+    }
+
+    bool empty() const {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Buffer {
+        int64_t capacity;
+        std::unique_ptr< std::atomic<PoolTask *>[] > slots;
+
+        explicit Buffer(int64_t capacity)
+            :   capacity(capacity), slots(new std::atomic<PoolTask *>[capacity]) {}
+        PoolTask *get(int64_t i) { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, PoolTask *task) { slots[i & (capacity - 1)].store(task, std::memory_order_relaxed); }
+    };
+
+    Buffer *grow(Buffer *a, int64_t b, int64_t t) {
+        // retired buffers stay alive until the deque dies, thieves may still read them
+        buffers.emplace_back(new Buffer(a->capacity * 2));
+        Buffer *next = buffers.back().get();
+        for (int64_t i = t; i < b; ++i)
+            next->put(i, a->get(i));
+        array.store(next, std::memory_order_release);
+        return next;
+    }
+
+    // keep owner and thieves on separate cache lines
+    std::atomic<int64_t> top;
+    char top_padding[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom;
+    char bottom_padding[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<Buffer *> array;
+    std::vector< std::unique_ptr<Buffer> > buffers;
+};
+
+// Work-stealing thread pool: one deque per worker, plus one deque owned by the
+// submitting thread. The thread calling parallel_for() takes part in the work,
+// so ThreadPool(n) runs parallel_for() on n threads in total.
 class ThreadPool {
 public:
     ThreadPool(size_t);
+    // run fn(rank) for every rank in [0, rank_count) and wait for completion
+    template<class F>
+    void parallel_for(int rank_count, F&& fn);
     template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) 
+    auto enqueue(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
+    size_t size() const { return workers.size() + 1; }
     ~ThreadPool();
 private:
+    struct BulkJob {
+        ThreadPool *pool;
+        void (*body)(const void *, int);
+        const void *fn;
+        std::atomic<int> pending;
+    };
+
+    struct RangeTask {
+        BulkJob *job;
+        int begin, end;
+    };
+
+    static void run_range(PoolTask *task, int self);
+    PoolTask *acquire_task(int self);
+    bool find_task(int self, PoolTask *&task);
+    void notify();
+    void worker_loop(int self);
+
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
-    
+    // deques[0] belongs to the submitting thread, deques[i] to workers[i - 1]
+    std::vector< std::unique_ptr<TaskDeque> > deques;
+
+    // preallocated storage for the ranges split off by parallel_for()
+    std::vector< PoolTask > slab;
+    std::atomic<int> slab_used;
+
     // synchronization
-    std::mutex queue_mutex;
+    std::mutex submit_mutex;
+    std::mutex park_mutex;
     std::condition_variable condition;
-    bool stop;
+    std::atomic<uint64_t> signal;
+    std::atomic<int> sleepers;
+    std::atomic<bool> stop;
+
+    static const int spin_count = 1 << 12;
 };
- 
-// the constructor just launches some amount of workers
+
 inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false)
+    :   slab_used(0), signal(0), sleepers(0), stop(false)
 {
-    for(size_t i = 0;i<threads;++i)
-        workers.emplace_back(
-            [this]
-            {
-                for(;;)
-                {
-                    std::function<void()> task;
-
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock,
-                            [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-
-                    task();
-                }
-            }
-        );
+    if (threads < 1)
+        threads = 1;
+    for (size_t i = 0; i < threads; ++i)
+        deques.emplace_back(new TaskDeque());
+    for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back([this, i] { this->worker_loop(int(i)); });
+}
+
+inline void ThreadPool::notify()
+{
+    signal.fetch_add(1, std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        condition.notify_all();
+    }
+}
+
+inline bool ThreadPool::find_task(int self, PoolTask *&task)
+{
+    task = deques[self]->pop();
+    if (task)
+        return true;
+    int n = int(deques.size());
+    for (int k = 1; k < n; ++k) {
+        task = deques[(self + k) % n]->steal();
+        if (task)
+            return true;
+    }
+    return false;
 }
 
-// add new work item to the pool
+inline PoolTask *ThreadPool::acquire_task(int self)
+{
+    PoolTask *task = nullptr;
+    for (int spin = 0; spin < spin_count; ++spin) {
+        if (find_task(self, task))
+            return task;
+        THREAD_POOL_RELAX();
+    }
+    return nullptr;
+}
+
+inline void ThreadPool::worker_loop(int self)
+{
+    for (;;) {
+        uint64_t seen = signal.load(std::memory_order_seq_cst);
+        PoolTask *task = acquire_task(self);
+        if (task) {
+            task->invoke(task, self);
+            continue;
+        }
+        if (stop.load(std::memory_order_acquire))
+            return;
+
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(park_mutex);
+            condition.wait(lock, [this, seen] {
+                return stop.load(std::memory_order_acquire) || signal.load(std::memory_order_seq_cst) != seen;
+            });
+        }
+        sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
+// Lazy binary splitting: keep halving the range and publish the upper half
+// on the own deque for thieves, then run whatever is left inline.
+inline void ThreadPool::run_range(PoolTask *task, int self)
+{
+    RangeTask range = *task->data<RangeTask>();
+    BulkJob *job = range.job;
+    ThreadPool *pool = job->pool;
+    while (range.end - range.begin > 1) {
+        int mid = range.begin + (range.end - range.begin) / 2;
+        PoolTask *half = &pool->slab[pool->slab_used.fetch_add(1, std::memory_order_relaxed)];
+        half->invoke = run_range;
+        *half->data<RangeTask>() = RangeTask{job, mid, range.end};
+        pool->deques[self]->push(half);
+        pool->notify();
+        range.end = mid;
+    }
+    for (int rank = range.begin; rank < range.end; ++rank)
+        job->body(job->fn, rank);
+    // last touch of the job: the submitter may return as soon as this hits zero
+    job->pending.fetch_sub(range.end - range.begin, std::memory_order_acq_rel);
+}
+
+template<class F>
+void ThreadPool::parallel_for(int rank_count, F&& fn)
+{
+    typedef typename std::remove_reference<F>::type function_type;
+    if (rank_count <= 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(submit_mutex);
+    if (stop.load(std::memory_order_acquire))
+        throw std::runtime_error("parallel_for on stopped ThreadPool");
+
+    // every split consumes one slot, a range of N ranks is split at most N - 1 times
+    if (slab.size() < size_t(rank_count))
+        slab.resize(rank_count);
+    slab_used.store(1, std::memory_order_relaxed);
+
+    BulkJob job;
+    job.pool = this;
+    job.body = [](const void *f, int rank) { (*static_cast<function_type *>(const_cast<void *>(f)))(rank); };
+    job.fn = &fn;
+    job.pending.store(rank_count, std::memory_order_relaxed);
+
+    PoolTask *root = &slab[0];
+    root->invoke = run_range;
+    *root->data<RangeTask>() = RangeTask{&job, 0, rank_count};
+    deques[0]->push(root);
+    if (!workers.empty())
+        notify();
+
+    // the submitting thread works as well until every rank is done
+    PoolTask *task = nullptr;
+    while (job.pending.load(std::memory_order_acquire) > 0) {
+        if (find_task(0, task))
+            task->invoke(task, 0);
+        else
+            THREAD_POOL_RELAX();
+    }
+}
+
+// add new work item to the pool, kept for callers that need a future per task
 template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) 
+auto ThreadPool::enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>
 {
     using return_type = typename std::result_of<F(Args...)>::type;
+    struct Payload {
+        std::packaged_task<return_type()> *fn;
+    };
 
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
+    auto fn = new std::packaged_task<return_type()>(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...)
         );
-        
-    std::future<return_type> res = task->get_future();
+    std::future<return_type> res = fn->get_future();
+
+    PoolTask *task = new PoolTask;
+    task->invoke = [](PoolTask *self, int) {
+        std::packaged_task<return_type()> *fn = self->data<Payload>()->fn;
+        delete self;
+        (*fn)();
+        delete fn;
+    };
+    task->data<Payload>()->fn = fn;
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::lock_guard<std::mutex> lock(submit_mutex);
 
         // don't allow enqueueing after stopping the pool
-        if(stop)
+        if (stop.load(std::memory_order_acquire)) {
+            delete task;
+            delete fn;
             throw std::runtime_error("enqueue on stopped ThreadPool");
-
-        tasks.emplace([task](){ (*task)(); });
+        }
+        if (!workers.empty())
+            deques[0]->push(task);
     }
-    condition.notify_one();
+    if (workers.empty())
+        task->invoke(task, 0);
+    else
+        notify();
     return res;
 }
 
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool()
 {
+    stop.store(true, std::memory_order_release);
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+        std::lock_guard<std::mutex> lock(park_mutex);
+        condition.notify_all();
     }
-    condition.notify_all();
     for(std::thread &worker: workers)
         worker.join();
 }
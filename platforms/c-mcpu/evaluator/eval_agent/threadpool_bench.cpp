@@ -0,0 +1,149 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Dispatch latency of one kernel launch (N ranks) on the legacy mutex/condvar
+// pool, the work-stealing ThreadPool and the resident ThreadTeam.
+//
+// Build & run:
+//   g++ threadpool_bench.cpp -o threadpool_bench -std=c++11 -lpthread -O3 -march=native
+//   ./threadpool_bench [threads=8] [launches=20000]
+
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include "threadpool.h"
+#include "thread_team.h"
+
+// The pool threadpool.h shipped before work stealing, kept only as baseline.
+class LegacyThreadPool {
+public:
+    LegacyThreadPool(size_t threads)
+        :   stop(false)
+    {
+        for(size_t i = 0;i<threads;++i)
+            workers.emplace_back(
+                [this]
+                {
+                    for(;;)
+                    {
+                        std::function<void()> task;
+
+                        {
+                            std::unique_lock<std::mutex> lock(this->queue_mutex);
+                            this->condition.wait(lock,
+                                [this]{ return this->stop || !this->tasks.empty(); });
+                            if(this->stop && this->tasks.empty())
+                                return;
+                            task = std::move(this->tasks.front());
+                            this->tasks.pop();
+                        }
+
+                        task();
+                    }
+                }
+            );
+    }
+
+    template<class F, class... Args>
+    auto enqueue(F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type>
+    {
+        using return_type = typename std::result_of<F(Args...)>::type;
+
+        auto task = std::make_shared< std::packaged_task<return_type()> >(
+                std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+            );
+
+        std::future<return_type> res = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            tasks.emplace([task](){ (*task)(); });
+        }
+        condition.notify_one();
+        return res;
+    }
+
+    ~LegacyThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for(std::thread &worker: workers)
+            worker.join();
+    }
+
+private:
+    std::vector< std::thread > workers;
+    std::queue< std::function<void()> > tasks;
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    bool stop;
+};
+
+static std::atomic<long> sink(0);
+
+static void kernel_main(int rank) {
+    sink.fetch_add(rank, std::memory_order_relaxed);
+}
+
+template<class F>
+static double measure(int launches, F&& launch) {
+    for (int i = 0; i < launches / 10 + 1; ++i)
+        launch();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < launches; ++i)
+        launch();
+    auto t2 = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count() / launches;
+}
+
+int main(int argc, char **argv)
+{
+    int threads = argc > 1 ? std::atoi(argv[1]) : 8;
+    int launches = argc > 2 ? std::atoi(argv[2]) : 20000;
+
+    double legacy, stealing, team;
+    {
+        LegacyThreadPool pool(threads);
+        std::vector< std::future<void> > results;
+        results.reserve(threads);
+        legacy = measure(launches, [&]() {
+            results.clear();
+            for (int j = 0; j < threads; ++j)
+                results.emplace_back(pool.enqueue(kernel_main, j));
+            for (auto &&result: results)
+                result.get();
+        });
+    }
+    {
+        ThreadPool pool(threads);
+        stealing = measure(launches, [&]() {
+            pool.parallel_for(threads, [](int j) { kernel_main(j); });
+        });
+    }
+    {
+        ThreadTeam members(threads);
+        team = measure(launches, [&]() {
+            members.run([](int j) { kernel_main(j); });
+        });
+    }
+
+    long expected = long(threads) * (threads - 1) / 2 * 3 * (launches + launches / 10 + 1);
+    if (sink.load() != expected) {
+        printf("[FATAL] Lost ranks: %ld v.s. (expected) %ld\n", sink.load(), expected);
+        return 1;
+    }
+    printf("- THREADS = %d\n", threads);
+    printf("- LEGACY_DISPATCH = %.6e\n", legacy);
+    printf("- STEALING_DISPATCH = %.6e\n", stealing);
+    printf("- TEAM_DISPATCH = %.6e\n", team);
+    printf("- SPEEDUP = %.3f\n", legacy / stealing);
+    printf("- TEAM_SPEEDUP = %.3f\n", legacy / team);
+    return 0;
+}
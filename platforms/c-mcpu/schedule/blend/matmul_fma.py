@@ -0,0 +1,307 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+import tvm
+from tvm import te
+from ..standard.default import define_launch_knobs
+
+# Lowers `C[.., M, N] +=! A[.., M, K] * B[.., K, N]` (float32) onto a packed, register-blocked
+# FMA microkernel: 14x32 with AVX-512, 6x16 with AVX2 + FMA, a scalar 4x8 tile otherwise.
+# The loops over MC x NC x KC blocks are left to TVM, each block is one call to the blend.
+# Select it with `## @: plan/c-mcpu=blend.matmul_fma`.
+#
+# B may also be transposed (`B[.., N, K]`, i.e. A * B^T), it is then packed by columns. Other
+# contractions, such as convolutions, a transposed A or several reduce axes, are not lowered
+# by the matmul blends and are left to the standard schedule.
+#
+# A and B may also be float16 or bfloat16 cast to a float32 C (`A[..].cast(`float32`)`):
+# packing converts them, the microkernel accumulates in fp32. With AVX512-BF16, bfloat16
+# operands stay packed as pairs along K and are multiplied by `vdpbf16ps` instead.
+
+def intrin_gemm(mc, nc, kc, in_dtype, out_dtype, trans_b):
+  a = te.placeholder((mc, kc), name='a', dtype=in_dtype)
+  b = te.placeholder((nc, kc) if trans_b else (kc, nc), name='b', dtype=in_dtype)
+  b_at = (lambda k, j: b[j, k]) if trans_b else (lambda k, j: b[k, j])
+  k = te.reduce_axis((0, kc), name='k')
+  if in_dtype == out_dtype:
+    c = te.compute((mc, nc), lambda i, j: te.sum(a[i, k] * b_at(k, j), axis=k), name='c')
+  else:
+    c = te.compute((mc, nc), lambda i, j: te.sum(a[i, k].astype(out_dtype) * b_at(k, j).astype(out_dtype), axis=k), name='c')
+
+  a_buf = tvm.tir.decl_buffer(a.shape, a.dtype, name='a_buf', offset_factor=1, strides=[te.var('lda'), 1])
+  b_buf = tvm.tir.decl_buffer(b.shape, b.dtype, name='b_buf', offset_factor=1, strides=[te.var('ldb'), 1])
+  c_buf = tvm.tir.decl_buffer(c.shape, c.dtype, name='c_buf', offset_factor=1, strides=[te.var('ldc'), 1])
+
+  def intrin_func(ins, outs):
+    aa, bb = ins
+    cc = outs[0]
+
+    # B(k, j) is read at B[k * ldbk + j * ldbn]
+    ldbk, ldbn = (1, bb.strides[0]) if trans_b else (bb.strides[0], 1)
+
+    def gemm_block(accumulate):
+      ib = tvm.tir.ir_builder.create()
+      ib.emit(tvm.tir.call_extern('int32', 'antares_gemm_block', cc.access_ptr('rw'), aa.access_ptr('r'), bb.access_ptr('r'),
+        mc, nc, kc, aa.strides[0], ldbk, ldbn, cc.strides[0], accumulate))
+      return ib.get()
+
+    def gemm_zero():
+      ib = tvm.tir.ir_builder.create()
+      ib.emit(tvm.tir.call_extern('int32', 'antares_gemm_zero', cc.access_ptr('w'), mc, nc, cc.strides[0]))
+      return ib.get()
+
+    return gemm_block(0), gemm_zero(), gemm_block(1)
+
+  return te.decl_tensor_intrin(c.op, intrin_func, binds={a: a_buf, b: b_buf, c: c_buf})
+
+def is_transposed_b(C):
+  # A has to be read as A[.., M, K], B as B[.., K, N] or as B[.., N, K]
+  m, n, k = C.op.axis[-2].var, C.op.axis[-1].var, C.op.reduce_axis[0].var
+  loads = []
+  tvm.tir.stmt_functor.post_order_visit(C.op.body[0], lambda x: loads.append(x) if isinstance(x, tvm.tir.ProducerLoad) else None)
+  def reads(load, outer, inner):
+    return len(load.indices) >= 2 and load.indices[-2].same_as(outer) and load.indices[-1].same_as(inner)
+  assert len(loads) == 2 and reads(loads[0], m, k) and (reads(loads[1], k, n) or reads(loads[1], n, k)), "The matmul blends only support A[.., M, K] times B[.., K, N] or B[.., N, K]."
+  return reads(loads[1], n, k)
+
+def block_choices(extent, candidates):
+  choices = [x for x in candidates if x < extent and extent % x == 0]
+  return choices + [extent]
+
+# Splits C into MC x NC x KC blocks over the ranks and tensorizes every block into a call of
+# the blend's antares_gemm_block(), shared with the other matmul blends.
+def schedule_gemm_blocks(attrs, in_dtype):
+  cfg, s, C = attrs.auto_config, attrs.scheduler, attrs.outputs[0]
+  plan_threads, plan_chunks = define_launch_knobs(attrs)
+
+  batch, (y, x), k = s[C].op.axis[:-2], s[C].op.axis[-2:], s[C].op.reduce_axis[0]
+  m, n, K = attrs.get_extent(y), attrs.get_extent(x), attrs.get_extent(k)
+
+  # GotoBLAS-style blocking: MC x KC of A is meant to stay in L2, KC x NC of B in L3
+  cfg.define_knob("MC", block_choices(m, [48, 96, 144, 192, 288]))
+  cfg.define_knob("NC", block_choices(n, [64, 128, 256, 512, 1024]))
+  cfg.define_knob("KC", block_choices(K, [64, 128, 256, 384, 512]))
+  mc, nc, kc = cfg['MC'].val, cfg['NC'].val, cfg['KC'].val
+
+  yo, yi = s[C].split(y, factor=mc)
+  xo, xi = s[C].split(x, factor=nc)
+  ko, ki = s[C].split(k, factor=kc)
+  s[C].reorder(*batch, yo, xo, ko, yi, xi, ki)
+
+  fused = s[C].fuse(*batch, yo, xo)
+  fo, fi = s[C].split(fused, nparts=plan_threads * plan_chunks)
+  s[C].bind(fo, te.thread_axis('threadIdx.x'))
+  s[C].tensorize(yi, intrin_gemm(mc, nc, kc, in_dtype, C.dtype, is_transposed_b(C)))
+  return mc, kc
+
+def schedule(attrs):
+  C = attrs.outputs[0]
+  assert len(C.op.reduce_axis) == 1 and len(C.op.axis) >= 2, "Blend `matmul_fma` only supports matmul / batch_matmul contractions."
+  in_dtype = C.op.input_tensors[0].dtype
+  assert C.dtype == 'float32' and in_dtype in ('float32', 'float16', 'bfloat16'), "Blend `matmul_fma` only supports float32 contractions of float32 / float16 / bfloat16 operands."
+  assert all([x.dtype == in_dtype for x in C.op.input_tensors]), "Blend `matmul_fma` expects operands of one type."
+  mc, kc = schedule_gemm_blocks(attrs, in_dtype)
+
+  attrs.blend = '''
+#include <immintrin.h>
+#include <string.h>
+
+// block tile of the schedule, which bounds the packing scratch below
+#define GEMM_BLOCK_M %d
+#define GEMM_BLOCK_K %d
+''' % (mc, kc) + '''
+// Register tile of the FMA microkernel: MR rows of A times NR columns of B stay
+// in vector registers for the whole KC loop.
+#if defined(__AVX512F__)
+#define GEMM_MR 14
+#define GEMM_NR 32
+#define GEMM_VL 16
+typedef __m512 gemm_vec;
+#define gemm_load _mm512_loadu_ps
+#define gemm_store _mm512_storeu_ps
+#define gemm_set1 _mm512_set1_ps
+#define gemm_zero _mm512_setzero_ps
+#define gemm_fma(a, b, c) _mm512_fmadd_ps(a, b, c)
+#elif defined(__AVX2__) && defined(__FMA__)
+#define GEMM_MR 6
+#define GEMM_NR 16
+#define GEMM_VL 8
+typedef __m256 gemm_vec;
+#define gemm_load _mm256_loadu_ps
+#define gemm_store _mm256_storeu_ps
+#define gemm_set1 _mm256_set1_ps
+#define gemm_zero _mm256_setzero_ps
+#define gemm_fma(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define GEMM_MR 4
+#define GEMM_NR 8
+#define GEMM_VL 1
+typedef float gemm_vec;
+#define gemm_load(p) (*(p))
+#define gemm_store(p, v) (*(p) = (v))
+#define gemm_set1(x) (x)
+#define gemm_zero() 0.0f
+#define gemm_fma(a, b, c) ((a) * (b) + (c))
+#endif
+
+// Packing scratch lives on the stack of the calling rank: K is consumed GEMM_KB values at a
+// time, A is packed GEMM_MP panels of MR rows at a time (about 1MB at most), B one NR panel
+// at a time. Nothing outlives a call, so the kernel library keeps no per-thread state.
+static const int GEMM_KB = GEMM_BLOCK_K < 512 ? GEMM_BLOCK_K : 512;
+static const int GEMM_MP_FIT = (1 << 20) / (GEMM_KB * GEMM_MR * int(sizeof(float)));
+static const int GEMM_MP_BLOCK = (GEMM_BLOCK_M + GEMM_MR - 1) / GEMM_MR;
+static const int GEMM_MP = GEMM_MP_BLOCK < GEMM_MP_FIT ? GEMM_MP_BLOCK : (GEMM_MP_FIT > 0 ? GEMM_MP_FIT : 1);
+
+// c[MR x NR] (+)= packed A panel (kc x MR) * packed B panel (kc x NR)
+static inline void gemm_microkernel(int kc, const float *pa, const float *pb, float *c, int ldc, int accumulate) {
+  gemm_vec acc[GEMM_MR][GEMM_NR / GEMM_VL];
+  for (int i = 0; i < GEMM_MR; ++i)
+    for (int v = 0; v < GEMM_NR / GEMM_VL; ++v)
+      acc[i][v] = gemm_zero();
+  for (int k = 0; k < kc; ++k, pa += GEMM_MR, pb += GEMM_NR) {
+    gemm_vec b[GEMM_NR / GEMM_VL];
+    for (int v = 0; v < GEMM_NR / GEMM_VL; ++v)
+      b[v] = gemm_load(pb + v * GEMM_VL);
+    for (int i = 0; i < GEMM_MR; ++i) {
+      gemm_vec a = gemm_set1(pa[i]);
+      for (int v = 0; v < GEMM_NR / GEMM_VL; ++v)
+        acc[i][v] = gemm_fma(a, b[v], acc[i][v]);
+    }
+  }
+  for (int i = 0; i < GEMM_MR; ++i)
+    for (int v = 0; v < GEMM_NR / GEMM_VL; ++v) {
+      if (accumulate)
+        acc[i][v] = acc[i][v] + gemm_load(c + i * ldc + v * GEMM_VL);
+      gemm_store(c + i * ldc + v * GEMM_VL, acc[i][v]);
+    }
+}
+
+// Runs C[mc x nc] (+)= A[mc x kc] * B[kc x nc] as a sequence of packed steps on the caller's
+// scratch: pack_a(i0, rows, k0, kb) packs GEMM_MP panels of A, pack_b(jp, cols, k0, kb) one
+// panel of B, which micro(ip, kb, c, ldc, accumulate) then multiplies with every panel of A.
+// Partial edge tiles go through a scratch tile.
+template<class PackA, class PackB, class F>
+static void gemm_steps(float *C, int mc, int nc, int kc, int ldc, int accumulate, PackA pack_a, PackB pack_b, F micro) {
+  float tile[GEMM_MR * GEMM_NR];
+  int np = (nc + GEMM_NR - 1) / GEMM_NR;
+  for (int k0 = 0; k0 < kc; k0 += GEMM_KB, accumulate = 1) {
+    int kb = kc - k0 < GEMM_KB ? kc - k0 : GEMM_KB;
+    for (int i0 = 0; i0 < mc; i0 += GEMM_MP * GEMM_MR) {
+      int mb = mc - i0 < GEMM_MP * GEMM_MR ? mc - i0 : GEMM_MP * GEMM_MR, mp = (mb + GEMM_MR - 1) / GEMM_MR;
+      pack_a(i0, mb, k0, kb);
+      for (int jp = 0; jp < np; ++jp) {
+        int cols = nc - jp * GEMM_NR < GEMM_NR ? nc - jp * GEMM_NR : GEMM_NR;
+        pack_b(jp, cols, k0, kb);
+        for (int ip = 0; ip < mp; ++ip) {
+          int rows = mb - ip * GEMM_MR < GEMM_MR ? mb - ip * GEMM_MR : GEMM_MR;
+          float *c = C + size_t(i0 + ip * GEMM_MR) * ldc + jp * GEMM_NR;
+          if (rows == GEMM_MR && cols == GEMM_NR) {
+            micro(ip, kb, c, ldc, accumulate);
+            continue;
+          }
+          micro(ip, kb, tile, GEMM_NR, 0);
+          for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+              c[i * ldc + j] = accumulate ? c[i * ldc + j] + tile[i * GEMM_NR + j] : tile[i * GEMM_NR + j];
+        }
+      }
+    }
+  }
+}
+
+// C[mc x nc] (+)= A[mc x kc] * B[kc x nc], A and C row-major with leading dimensions lda/ldc,
+// B(k, j) at B[k * ldbk + j * ldbn], i.e. (ldb, 1) row-major or (1, ldb) transposed.
+// Both operands are packed (and converted to float) into zero padded MR / NR panels first.
+template<class T>
+static int antares_gemm_block(float *C, const T *A, const T *B, int mc, int nc, int kc, int lda, int ldbk, int ldbn, int ldc, int accumulate) {
+  float packed_a[GEMM_MP * GEMM_KB * GEMM_MR], packed_b[GEMM_KB * GEMM_NR];
+  gemm_steps(C, mc, nc, kc, ldc, accumulate, [&](int i0, int rows, int k0, int kb) {
+    for (int ip = 0; ip * GEMM_MR < rows; ++ip) {
+      float *pa = packed_a + size_t(ip) * kb * GEMM_MR;
+      for (int k = 0; k < kb; ++k)
+        for (int i = 0; i < GEMM_MR; ++i) {
+          int row = ip * GEMM_MR + i;
+          pa[k * GEMM_MR + i] = row < rows ? float(A[size_t(i0 + row) * lda + k0 + k]) : 0.0f;
+        }
+    }
+  }, [&](int jp, int cols, int k0, int kb) {
+    for (int k = 0; k < kb; ++k) {
+      const T *src = B + size_t(k0 + k) * ldbk + size_t(jp * GEMM_NR) * ldbn;
+      for (int j = 0; j < cols; ++j)
+        packed_b[k * GEMM_NR + j] = float(src[size_t(j) * ldbn]);
+      for (int j = cols; j < GEMM_NR; ++j)
+        packed_b[k * GEMM_NR + j] = 0.0f;
+    }
+  }, [&](int ip, int kb, float *c, int ldc, int accumulate) {
+    gemm_microkernel(kb, packed_a + size_t(ip) * kb * GEMM_MR, packed_b, c, ldc, accumulate);
+  });
+  return 0;
+}
+static int antares_gemm_zero(float *C, int mc, int nc, int ldc) {
+  for (int i = 0; i < mc; ++i)
+    memset(C + size_t(i) * ldc, 0, nc * sizeof(float));
+  return 0;
+}
+'''
+
+  if in_dtype == 'bfloat16':
+    attrs.blend += '''
+#if defined(__AVX512BF16__)
+// vdpbf16ps multiplies pairs of bfloat16 along K into fp32 lanes: A is packed as one 32-bit
+// (k, k + 1) pair per row, B as (k, k + 1) pairs for each of the NR columns.
+static inline void gemm_microkernel_bf16(int kp, const unsigned *pa, const unsigned short *pb, float *c, int ldc, int accumulate) {
+  __m512 acc[GEMM_MR][GEMM_NR / 16];
+  for (int i = 0; i < GEMM_MR; ++i)
+    for (int v = 0; v < GEMM_NR / 16; ++v)
+      acc[i][v] = _mm512_setzero_ps();
+  for (int k = 0; k < kp; ++k, pa += GEMM_MR, pb += GEMM_NR * 2) {
+    __m512i b[GEMM_NR / 16];
+    for (int v = 0; v < GEMM_NR / 16; ++v)
+      b[v] = _mm512_loadu_si512(pb + v * 32);
+    for (int i = 0; i < GEMM_MR; ++i) {
+      __m512i a = _mm512_set1_epi32(pa[i]);
+      for (int v = 0; v < GEMM_NR / 16; ++v)
+        acc[i][v] = _mm512_dpbf16_ps(acc[i][v], (__m512bh)a, (__m512bh)b[v]);
+    }
+  }
+  for (int i = 0; i < GEMM_MR; ++i)
+    for (int v = 0; v < GEMM_NR / 16; ++v) {
+      if (accumulate)
+        acc[i][v] = _mm512_add_ps(acc[i][v], _mm512_loadu_ps(c + i * ldc + v * 16));
+      _mm512_storeu_ps(c + i * ldc + v * 16, acc[i][v]);
+    }
+}
+
+// K is packed in (k, k + 1) pairs, so GEMM_KB values of K are (GEMM_KB + 1) / 2 pairs.
+static int antares_gemm_block(float *C, const bfloat16 *A, const bfloat16 *B, int mc, int nc, int kc, int lda, int ldbk, int ldbn, int ldc, int accumulate) {
+  unsigned packed_a[GEMM_MP * (GEMM_KB + 1) / 2 * GEMM_MR];
+  unsigned short packed_b[(GEMM_KB + 1) / 2 * GEMM_NR * 2];
+  gemm_steps(C, mc, nc, kc, ldc, accumulate, [&](int i0, int rows, int k0, int kb) {
+    int kp = (kb + 1) / 2;
+    for (int ip = 0; ip * GEMM_MR < rows; ++ip) {
+      unsigned *pa = packed_a + size_t(ip) * kp * GEMM_MR;
+      for (int k = 0; k < kp; ++k)
+        for (int i = 0; i < GEMM_MR; ++i) {
+          int row = ip * GEMM_MR + i;
+          const bfloat16 *src = A + size_t(i0 + row) * lda + k0 + 2 * k;
+          unsigned lo = row < rows ? src[0].bits : 0;
+          unsigned hi = row < rows && 2 * k + 1 < kb ? src[1].bits : 0;
+          pa[k * GEMM_MR + i] = lo | (hi << 16);
+        }
+    }
+  }, [&](int jp, int cols, int k0, int kb) {
+    for (int k = 0; k < (kb + 1) / 2; ++k) {
+      const bfloat16 *even = B + size_t(k0 + 2 * k) * ldbk + size_t(jp * GEMM_NR) * ldbn, *odd = even + ldbk;
+      for (int j = 0; j < GEMM_NR; ++j) {
+        packed_b[(k * GEMM_NR + j) * 2] = j < cols ? even[size_t(j) * ldbn].bits : 0;
+        packed_b[(k * GEMM_NR + j) * 2 + 1] = j < cols && 2 * k + 1 < kb ? odd[size_t(j) * ldbn].bits : 0;
+      }
+    }
+  }, [&](int ip, int kb, float *c, int ldc, int accumulate) {
+    int kp = (kb + 1) / 2;
+    gemm_microkernel_bf16(kp, packed_a + size_t(ip) * kp * GEMM_MR, packed_b, c, ldc, accumulate);
+  });
+  return 0;
+}
+#endif
+'''
@@ -0,0 +1,181 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+from .matmul_fma import schedule_gemm_blocks
+
+# Lowers quantized `C[.., M, N] +=! A[.., M, K].cast(`int32`) * B[.., K, N].cast(`int32`)` with
+# int8 A and B onto a packed integer dot-product microkernel, blocked like `matmul_fma`:
+#   AVX512-VNNI  vpdpbusd on 14x32 tiles, 4 products of K per 32-bit lane
+#   AVX-VNNI     vpdpbusd on 6x16 tiles
+#   AVX2         vpmaddwd on 6x16 tiles, 2 products of K per 32-bit lane
+# vpdpbusd multiplies unsigned by signed bytes, so A is packed biased by +128 and 128 * column
+# sums of B are subtracted from C again. Both operands are packed into K groups per 32-bit
+# lane: A as one broadcast group per row, B as one group per column.
+# Select it with `## @: plan/c-mcpu=blend.matmul_vnni`. B may be transposed as in `matmul_fma`.
+
+def schedule(attrs):
+  C = attrs.outputs[0]
+  assert len(C.op.reduce_axis) == 1 and len(C.op.axis) >= 2, "Blend `matmul_vnni` only supports matmul / batch_matmul contractions."
+  assert C.dtype == 'int32' and all([x.dtype == 'int8' for x in C.op.input_tensors]), "Blend `matmul_vnni` only supports int8 x int8 -> int32 contractions."
+  mc, kc = schedule_gemm_blocks(attrs, 'int8')
+
+  attrs.blend = '''
+#include <immintrin.h>
+#include <string.h>
+
+// block tile of the schedule, which bounds the packing scratch below
+#define QGEMM_BLOCK_M %d
+#define QGEMM_BLOCK_K %d
+''' % (mc, kc) + '''
+// QGEMM_GROUP values of K share one 32-bit lane, QGEMM_BIAS is added to every value of A.
+#if defined(__AVX512VNNI__)
+#define QGEMM_MR 14
+#define QGEMM_NR 32
+#define QGEMM_VL 16
+#define QGEMM_GROUP 4
+#define QGEMM_BIAS 128
+typedef __m512i qgemm_vec;
+#define qgemm_load(p) _mm512_loadu_si512(p)
+#define qgemm_store(p, v) _mm512_storeu_si512(p, v)
+#define qgemm_set1 _mm512_set1_epi32
+#define qgemm_zero _mm512_setzero_si512
+#define qgemm_add _mm512_add_epi32
+#define qgemm_sub _mm512_sub_epi32
+#define qgemm_dot(c, a, b) _mm512_dpbusd_epi32(c, a, b)
+#elif defined(__AVXVNNI__) || defined(__AVX2__)
+#define QGEMM_MR 6
+#define QGEMM_NR 16
+#define QGEMM_VL 8
+typedef __m256i qgemm_vec;
+#define qgemm_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define qgemm_store(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define qgemm_set1 _mm256_set1_epi32
+#define qgemm_zero _mm256_setzero_si256
+#define qgemm_add _mm256_add_epi32
+#define qgemm_sub _mm256_sub_epi32
+#if defined(__AVXVNNI__)
+#define QGEMM_GROUP 4
+#define QGEMM_BIAS 128
+#define qgemm_dot(c, a, b) _mm256_dpbusd_avx_epi32(c, a, b)
+#else
+// vpmaddubsw would saturate on pairs of u8 x s8 products, sign extended pairs stay exact
+#define QGEMM_GROUP 2
+#define QGEMM_BIAS 0
+#define qgemm_dot(c, a, b) _mm256_add_epi32(c, _mm256_madd_epi16(a, b))
+#endif
+#else
+#define QGEMM_MR 4
+#define QGEMM_NR 8
+#define QGEMM_VL 1
+#define QGEMM_GROUP 2
+#define QGEMM_BIAS 0
+typedef int qgemm_vec;
+#define qgemm_load(p) (*(p))
+#define qgemm_store(p, v) (*(p) = (v))
+#define qgemm_set1(x) (x)
+#define qgemm_zero() 0
+#define qgemm_add(a, b) ((a) + (b))
+#define qgemm_sub(a, b) ((a) - (b))
+#define qgemm_dot(c, a, b) ((c) + short(a) * short(b) + short((a) >> 16) * short((b) >> 16))
+#endif
+#define QGEMM_BITS (32 / QGEMM_GROUP)
+#define QGEMM_MASK ((1u << QGEMM_BITS) - 1)
+
+// c[MR x NR] (+)= packed A panel (kg x MR groups) * packed B panel (kg x NR groups) - comp[NR]
+static inline void qgemm_microkernel(int kg, const int *pa, const int *pb, const int *comp, int *c, int ldc, int accumulate) {
+  qgemm_vec acc[QGEMM_MR][QGEMM_NR / QGEMM_VL];
+  for (int i = 0; i < QGEMM_MR; ++i)
+    for (int v = 0; v < QGEMM_NR / QGEMM_VL; ++v)
+      acc[i][v] = qgemm_zero();
+  for (int k = 0; k < kg; ++k, pa += QGEMM_MR, pb += QGEMM_NR) {
+    qgemm_vec b[QGEMM_NR / QGEMM_VL];
+    for (int v = 0; v < QGEMM_NR / QGEMM_VL; ++v)
+      b[v] = qgemm_load(pb + v * QGEMM_VL);
+    for (int i = 0; i < QGEMM_MR; ++i) {
+      qgemm_vec a = qgemm_set1(pa[i]);
+      for (int v = 0; v < QGEMM_NR / QGEMM_VL; ++v)
+        acc[i][v] = qgemm_dot(acc[i][v], a, b[v]);
+    }
+  }
+  for (int i = 0; i < QGEMM_MR; ++i)
+    for (int v = 0; v < QGEMM_NR / QGEMM_VL; ++v) {
+      acc[i][v] = qgemm_sub(acc[i][v], qgemm_load(comp + v * QGEMM_VL));
+      if (accumulate)
+        acc[i][v] = qgemm_add(acc[i][v], qgemm_load(c + i * ldc + v * QGEMM_VL));
+      qgemm_store(c + i * ldc + v * QGEMM_VL, acc[i][v]);
+    }
+}
+
+// Packing scratch lives on the stack of the calling rank, as in `matmul_fma`: K is consumed
+// QGEMM_KB values at a time, A is packed QGEMM_MP panels at a time (about 1MB at most), B one
+// NR panel at a time, which is then multiplied with every packed panel of A.
+static const int QGEMM_KB = QGEMM_BLOCK_K < 512 ? QGEMM_BLOCK_K : 512;
+static const int QGEMM_KG = (QGEMM_KB + QGEMM_GROUP - 1) / QGEMM_GROUP;
+static const int QGEMM_MP_FIT = (1 << 20) / (QGEMM_KG * QGEMM_MR * int(sizeof(int)));
+static const int QGEMM_MP_BLOCK = (QGEMM_BLOCK_M + QGEMM_MR - 1) / QGEMM_MR;
+static const int QGEMM_MP = QGEMM_MP_BLOCK < QGEMM_MP_FIT ? QGEMM_MP_BLOCK : (QGEMM_MP_FIT > 0 ? QGEMM_MP_FIT : 1);
+
+// C[mc x nc] (+)= A[mc x kc] * B[kc x nc] in int32, A and C row-major with leading dimensions
+// lda/ldc, B(k, j) at B[k * ldbk + j * ldbn]. Padding of the packed panels is zero in B, so the
+// bias of A never reaches C.
+template<class T>
+static int antares_gemm_block(int *C, const T *A, const T *B, int mc, int nc, int kc, int lda, int ldbk, int ldbn, int ldc, int accumulate) {
+  int packed_a[QGEMM_MP * QGEMM_KG * QGEMM_MR], packed_b[QGEMM_KG * QGEMM_NR], comp[QGEMM_NR], tile[QGEMM_MR * QGEMM_NR];
+  int np = (nc + QGEMM_NR - 1) / QGEMM_NR;
+  for (int k0 = 0; k0 < kc; k0 += QGEMM_KB, accumulate = 1) {
+    int kb = kc - k0 < QGEMM_KB ? kc - k0 : QGEMM_KB, kg = (kb + QGEMM_GROUP - 1) / QGEMM_GROUP;
+    for (int i0 = 0; i0 < mc; i0 += QGEMM_MP * QGEMM_MR) {
+      int mb = mc - i0 < QGEMM_MP * QGEMM_MR ? mc - i0 : QGEMM_MP * QGEMM_MR, mp = (mb + QGEMM_MR - 1) / QGEMM_MR;
+      for (int ip = 0; ip < mp; ++ip) {
+        int *pa = packed_a + size_t(ip) * kg * QGEMM_MR;
+        for (int g = 0; g < kg; ++g)
+          for (int i = 0; i < QGEMM_MR; ++i) {
+            int row = ip * QGEMM_MR + i;
+            unsigned group = 0;
+            for (int t = 0, k = g * QGEMM_GROUP; t < QGEMM_GROUP; ++t, ++k) {
+              int value = row < mb && k < kb ? int(A[size_t(i0 + row) * lda + k0 + k]) : 0;
+              group |= (unsigned(value + QGEMM_BIAS) & QGEMM_MASK) << (t * QGEMM_BITS);
+            }
+            pa[g * QGEMM_MR + i] = int(group);
+          }
+      }
+
+      for (int jp = 0; jp < np; ++jp) {
+        int cols = nc - jp * QGEMM_NR < QGEMM_NR ? nc - jp * QGEMM_NR : QGEMM_NR;
+        memset(comp, 0, sizeof(comp));
+        for (int g = 0; g < kg; ++g)
+          for (int j = 0; j < QGEMM_NR; ++j) {
+            unsigned group = 0;
+            for (int t = 0, k = g * QGEMM_GROUP; t < QGEMM_GROUP; ++t, ++k) {
+              int value = j < cols && k < kb ? int(B[size_t(k0 + k) * ldbk + size_t(jp * QGEMM_NR + j) * ldbn]) : 0;
+              group |= (unsigned(value) & QGEMM_MASK) << (t * QGEMM_BITS);
+              comp[j] += QGEMM_BIAS * value;
+            }
+            packed_b[g * QGEMM_NR + j] = int(group);
+          }
+
+        for (int ip = 0; ip < mp; ++ip) {
+          int rows = mb - ip * QGEMM_MR < QGEMM_MR ? mb - ip * QGEMM_MR : QGEMM_MR;
+          const int *pa = packed_a + size_t(ip) * kg * QGEMM_MR;
+          int *c = C + size_t(i0 + ip * QGEMM_MR) * ldc + jp * QGEMM_NR;
+          if (rows == QGEMM_MR && cols == QGEMM_NR) {
+            qgemm_microkernel(kg, pa, packed_b, comp, c, ldc, accumulate);
+            continue;
+          }
+          qgemm_microkernel(kg, pa, packed_b, comp, tile, QGEMM_NR, 0);
+          for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+              c[i * ldc + j] = accumulate ? c[i * ldc + j] + tile[i * QGEMM_NR + j] : tile[i * QGEMM_NR + j];
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static int antares_gemm_zero(int *C, int mc, int nc, int ldc) {
+  for (int i = 0; i < mc; ++i)
+    memset(C + size_t(i) * ldc, 0, nc * sizeof(int));
+  return 0;
+}
+'''
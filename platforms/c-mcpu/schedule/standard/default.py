@@ -2,9 +2,116 @@
 # Licensed under the MIT license.
 
 from tvm import te
+from tvm.autotvm.task import ConfigEntity
 import numpy as np
+import os
 
 
+def device_property(key, def_val=0):
+  # device_properties.cfg is probed by engine/cpu_properties.cc, or describes another host
+  # through HARDWARE_CONFIG, so it takes precedence over what this process can see
+  try:
+    with open('%s/device_properties.cfg' % os.environ.get('ANTARES_DRIVER_PATH', '/tmp/libAntares')) as fp:
+      for line in fp:
+        if line.split(':')[0].strip() == key:
+          return int(line.split(':')[1])
+  except (OSError, ValueError):
+    pass
+  return def_val
+
+def detect_cache_sizes():
+  # data cache bytes per level on the target, used to bound the tile sizes of the search space
+  sizes = {1: 32 << 10, 2: 1 << 20}
+  for level, name, key in ((1, 'SC_LEVEL1_DCACHE_SIZE', 'L1DataCacheSize'), (2, 'SC_LEVEL2_CACHE_SIZE', 'L2CacheSize')):
+    size = device_property(key)
+    if size <= 0:
+      try:
+        size = os.sysconf(name)
+      except (ValueError, OSError):
+        size = 0
+    if size <= 0:
+      size = read_sysfs_cache_size(level)
+    if size > 0:
+      sizes[level] = size
+  return sizes[1], sizes[2]
+
+def read_sysfs_cache_size(level):
+  root = '/sys/devices/system/cpu/cpu0/cache'
+  if not os.path.isdir(root):
+    return 0
+  for index in os.listdir(root):
+    try:
+      with open(os.path.join(root, index, 'level')) as fp:
+        if int(fp.read()) != level:
+          continue
+      with open(os.path.join(root, index, 'type')) as fp:
+        if fp.read().strip() == 'Instruction':
+          continue
+      with open(os.path.join(root, index, 'size')) as fp:
+        size = fp.read().strip()
+      return int(size[:-1]) << {'K': 10, 'M': 20}[size[-1]] if size[-1] in 'KM' else int(size)
+    except (OSError, ValueError):
+      continue
+  return 0
+
+def thread_choices():
+  # CPU_THREADS pins the rank count, otherwise one rank per physical core comes first
+  if os.environ.get('CPU_THREADS'):
+    return [int(os.environ['CPU_THREADS'])]
+  num_cores, num_logical = device_property('PhysicalCores'), device_property('LogicalCores')
+  if num_cores <= 0 or num_logical <= 0:
+    logical = sorted(os.sched_getaffinity(0))
+    cores = set()
+    for cpu in logical:
+      try:
+        with open('/sys/devices/system/cpu/cpu%d/topology/physical_package_id' % cpu) as fp:
+          package = fp.read().strip()
+        with open('/sys/devices/system/cpu/cpu%d/topology/core_id' % cpu) as fp:
+          cores.add((package, fp.read().strip()))
+      except (OSError, ValueError):
+        cores.add(('', str(cpu)))
+    num_cores, num_logical = len(cores), len(logical)
+  choices = []
+  for threads in (num_cores, num_logical, num_cores // 2, 8):
+    if 1 <= threads <= num_logical and threads not in choices:
+      choices.append(threads)
+  return choices
+
+def define_launch_knobs(antares):
+  # The rank count and placement are searched along with the schedule. The chosen placement
+  # is written into the kernel (see `launch_options` in config.py), so that codehub entries
+  # run the way they were tuned.
+  # A non-zero `cpu_chunks` selects dynamic chunking: the parallel axis is split into that many
+  # parts per rank, which ranks claim from a shared counter (see `dynamic_chunks` in config.py).
+  # It balances kernels whose work per part is uneven, e.g. padding, concat or gather guarded
+  # by .when(). 0 keeps one static part per rank. The largest choice bounds the threadIdx.x
+  # extent, engine/cpu_properties.cc reports MaxThreadsPerBlock accordingly.
+  cfg = antares.auto_config
+  cfg.define_knob("cpu_threads", thread_choices())
+  cfg.define_knob("cpu_affinity", ['scatter', 'compact', 'numa'])
+  cfg.define_knob("cpu_chunks", [0, 8, 32])
+  antares.launch_options = {'CPU_AFFINITY': cfg['cpu_affinity'].val}
+  antares.rank_chunks = cfg['cpu_chunks'].val
+  return cfg['cpu_threads'].val, max(1, antares.rank_chunks)
+
+def reject_unused_knobs(cfg, used):
+  # Every knob is part of the space whichever mode a config picks, so the choices of a knob
+  # that the mode ignores would lower to the same kernel again. Only the first one is kept,
+  # the others fail here before compilation. All first choices are a split into [-1, 1, ..],
+  # the identity order or 0 / False.
+  if not isinstance(cfg, ConfigEntity):
+    return
+  for name, kind, value in cfg.to_json_dict()['entity']:
+    if used(name):
+      continue
+    if kind == 'sp':
+      first = all([x == 1 for x in value[1:]])
+    elif kind == 're':
+      first = list(value) == sorted(value)
+    else:
+      first = value == 0
+    assert first, "Knob `%s` is ignored by this config, only its first choice is searched." % name
+
 def schedule(antares):
   cfg, s, output = antares.auto_config, antares.scheduler, antares.outputs[0]
   th_vals, rd_vals = [antares.get_extent(x) for x in output.op.axis], [antares.get_extent(x) for x in output.op.reduce_axis]
@@ -12,51 +119,119 @@ def schedule(antares):
   inputs = antares.inputs
   program = antares.ir
 
-  import os
-  plan_threads = int(os.environ.get('CPU_THREADS', '8'))
+  plan_threads, plan_chunks = define_launch_knobs(antares)
 
   def mcpu_auto_schedule(s, output):
     cfg.define_knob("fuse_axis", [False])
     # fused = s[output].fuse(.. output.op.axis ..)
-    # if len(rd_vals) > 0:
-    #   if output.op in s.outputs:
-    #     output_local = s.cache_write(output, "local")
-    #   else:
-    #     s[output].set_scope('local')
-    #     output_local, output = output, s.outputs[0].output(0)
+
+    # Ranks either own disjoint output tiles (spatial) or split one reduction axis, in which
+    # case every rank reduces a partial result (rfactor) and the partials are tree-reduced
+    # across ranks. The latter wins for small outputs with long reductions.
+    can_reduce = rd_vals and output.op in s.outputs and not antares.explicit_ops[:-1]
+    cfg.define_knob("pa_mode", ['spatial', 'reduce'] if can_reduce else ['spatial'])
+    if can_reduce:
+      cfg.define_knob("pr_axis", np.arange(len(rd_vals)).tolist())
+      # ranks meet in barriers in the reduce mode, so they must all run at once and cannot claim chunks
+      if cfg['pa_mode'].val == 'reduce':
+        reject_unused_knobs(cfg, lambda name: name in ('fuse_axis', 'pa_mode', 'pr_axis', 'cpu_threads', 'cpu_affinity'))
+      else:
+        reject_unused_knobs(cfg, lambda name: name != 'pr_axis')
+
+    if cfg['pa_mode'].val == 'reduce':
+      pr_id = cfg['pr_axis'].val
+      ko, _ = s[output].split(output.op.reduce_axis[pr_id], nparts=plan_threads)
+      output_rf = s.rfactor(output, ko)
+      s[output_rf].set_scope('local')
+      rank_axis = s[output].op.reduce_axis[0]
+      s[output].bind(rank_axis, te.thread_axis('threadIdx.x'))
+      s[output_rf].compute_at(s[output], rank_axis)
+      return
+
+    # reductions accumulate into a register tile, written back once per tile
+    if rd_vals:
+      if output.op in s.outputs:
+        output_local = s.cache_write(output, "local")
+      else:
+        s[output].set_scope('local')
+        output_local, output = output, s.outputs[0].output(0)
 
     cfg.define_knob("pa_axis", np.arange(len(th_vals)).tolist())
     pa_id = cfg['pa_axis'].val
 
-    ax_high, ax_low = [], []
+    # lanes of the innermost (contiguous) output axis, emitted as floatN / intN vectors
+    cfg.define_knob("vectorize", [0, 4] if output.dtype in ('float32', 'int32') else [0])
+    vec_lanes, ax_vec = cfg['vectorize'].val, None
+
+    # Every spatial axis is split into outer x tile x register parts. Register tiles hold at
+    # most ~64 accumulators, a tile of all axes should fit in L2 together with its operands.
+    _, l2_size = detect_cache_sizes()
+    elem_bytes = max(1, int(''.join([x for x in output.dtype if x.isdigit()]) or '32') // 8)
+    inner_cap = max(2, int(round(64 ** (1.0 / len(th_vals)))))
+    tile_cap = max(inner_cap, int((l2_size // (3 * elem_bytes)) ** (1.0 / len(th_vals))))
+    def fits_cache(entity):
+      return entity.size[-1] <= inner_cap and entity.size[-1] * entity.size[-2] <= tile_cap
+
+    ax_outer, ax_mid, ax_inner = [], [], []
     for i in range(len(th_vals)):
       ax = output.op.axis[i]
-      cfg.define_split('axis_%d' % i, cfg.axis(ax), num_outputs=2)
-      axm, axi = cfg['axis_%d' % i].apply(s, output, ax)
+      cfg.define_split('axis_%d' % i, cfg.axis(ax), num_outputs=3, filter=fits_cache)
+      axo, axm, axi = cfg['axis_%d' % i].apply(s, output, ax)
 
       if pa_id == i:
-        axo, axm = s[output].split(axm, nparts=plan_threads)
-        s[output].bind(axo, te.thread_axis('threadIdx.x'))
+        axt, axo = s[output].split(axo, nparts=plan_threads * plan_chunks)
+        s[output].bind(axt, te.thread_axis('threadIdx.x'))
 
-      ax_high.append(axm)
-      ax_low.append(axi)
+      if vec_lanes > 0 and i == len(th_vals) - 1:
+        axi, ax_vec = s[output].split(axi, factor=vec_lanes)
 
-    for i in range(len(ax_high)):
-      s[output].bind(ax_high[i], te.thread_axis('vthread'))
-      s[output].bind(ax_low[i], te.thread_axis('vthread'))
+      ax_outer.append(axo)
+      ax_mid.append(axm)
+      ax_inner.append(axi)
 
-    cfg.define_reorder("reorder", ax_low, "all")
+    cfg.define_reorder("reorder", ax_mid, "all")
     perm = cfg['reorder'].perm
-    ex_ord = []
-    for i in perm:
-      ex_ord.append(ax_high[i])
-    for i in perm:
-      ex_ord.append(ax_low[i])
-    s[output].reorder(*reversed(ex_ord))
-
-    # if len(rd_vals) > 0:
-    #   s[output_local].compute_at(s[output], ex_ord[0])
+    ex_ord = ax_outer + [ax_mid[i] for i in perm] + [ax_inner[i] for i in perm]
+    if ax_vec is not None:
+      # a tail that does not fill all lanes is scalarized by TVM
+      s[output].reorder(*(ex_ord + [ax_vec]))
+      s[output].vectorize(ax_vec)
+    else:
+      s[output].reorder(*ex_ord)
+
+    for i in range(len(ax_inner)):
+      s[output].bind(ax_inner[i], te.thread_axis('vthread'))
+
+    cfg.define_knob("unroll", [0, 16, 64, 512])
+    unroll_stage, unroll_axis = s[output], ax_mid[perm[0]]
+
+    if rd_vals:
+      comp_ax = ax_mid[perm[-1]]
+      for m in antares.explicit_ops[:-1]:
+        s[m.output(0)].compute_at(s[output], comp_ax)
+      s[output_local].compute_at(s[output], comp_ax)
+
+      rd_outer, rd_inner = [], []
+      for i in range(len(rd_vals)):
+        ax_name = 'reduce_%d' % i
+        cfg.define_split(ax_name, cfg.axis(output_local.op.reduce_axis[i]), num_outputs=2, filter=lambda entity: entity.size[-1] <= tile_cap)
+        rko, rki = cfg[ax_name].apply(s, output_local, output_local.op.reduce_axis[i])
+        rd_outer.append(rko)
+        rd_inner.append(rki)
+
+      # the spatial axes of the register tile go innermost, so every reduction step updates all accumulators
+      cfg.define_reorder("reorder_reduce", rd_outer, "all")
+      rd_perm = cfg['reorder_reduce'].perm
+      local_axes = list(s[output_local].op.axis)
+      if vec_lanes > 0:
+        local_axes[-1], local_vec = s[output_local].split(local_axes[-1], factor=vec_lanes)
+        local_axes.append(local_vec)
+        s[output_local].vectorize(local_vec)
+      s[output_local].reorder(*([rd_outer[i] for i in rd_perm] + [rd_inner[i] for i in rd_perm] + local_axes))
+      unroll_stage, unroll_axis = s[output_local], rd_outer[rd_perm[0]]
+
+    if cfg['unroll'].val > 0:
+      unroll_stage.pragma(unroll_axis, 'auto_unroll_max_step', cfg['unroll'].val)
     return
 
   return mcpu_auto_schedule(s, output)
-
@@ -4,11 +4,73 @@
 import os, time, math
 import numpy as np
 import subprocess
+import threading, select, atexit
 
 from antares.common import backend
 
+class EvaluatorDaemon(object):
+    """The evaluator of one device started with `--daemon`, so that the device context,
+    pinned host buffers and device allocations stay warm across kernels."""
+
+    def __init__(self, evaluator_path, dev_id):
+        self.evaluator_path = evaluator_path
+        self.dev_id = dev_id
+        self.proc = None
+        self.lock = threading.Lock()
+
+    def start(self):
+        if self.proc is not None and self.proc.poll() is None:
+            return
+        env = dict(os.environ, CUDA_VISIBLE_DEVICES=str(self.dev_id))
+        self.proc = subprocess.Popen([self.evaluator_path, '--daemon'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env=env)
+
+    def stop(self):
+        if self.proc is not None:
+            self.proc.kill()
+            self.proc.wait()
+            self.proc = None
+
+    def run(self, kernel_dir, options={}, timeout=30):
+        request = ' '.join([kernel_dir] + ['%s=%s' % (k, options[k]) for k in options]) + '\n'
+        output, deadline = b'', time.time() + timeout
+        with self.lock:
+            self.start()
+            try:
+                self.proc.stdin.write(request.encode())
+                self.proc.stdin.flush()
+                while not output.endswith(b'[DONE]\n'):
+                    remaining = deadline - time.time()
+                    if remaining <= 0 or not select.select([self.proc.stdout], [], [], remaining)[0]:
+                        raise Exception('Time limit exceeded for this evaluation.')
+                    chunk = os.read(self.proc.stdout.fileno(), 4096)
+                    if not chunk:
+                        raise Exception('Evaluator process exited unexpectedly.')
+                    output += chunk
+            except Exception as e:
+                # a hung or faulted kernel may leave the device context unusable, restart on next request
+                self.stop()
+                raise Exception("Invalid runtime kernel execution: %s\n\nReason: %s\n%s" % (kernel_dir, e, output.decode()))
+        output = output[:-len(b'[DONE]\n')].decode()
+        if '[ERROR]' in output:
+            raise Exception("Invalid runtime kernel execution: %s\n\nReason: %s" % (kernel_dir, output))
+        return output
+
+daemons, daemons_lock = {}, threading.Lock()
+
+def get_daemon(evaluator_path, dev_id):
+    with daemons_lock:
+        if (evaluator_path, dev_id) not in daemons:
+            daemons[(evaluator_path, dev_id)] = EvaluatorDaemon(evaluator_path, dev_id)
+        return daemons[(evaluator_path, dev_id)]
+
+@atexit.register
+def stop_daemons():
+    for daemon in daemons.values():
+        daemon.stop()
+
 def eval(kernel_path, **kwargs):
     dev_id = kwargs['dev_id']
+    kernel_dir = os.path.dirname(os.path.abspath(kernel_path))
     curr_dir = os.getcwd()
     os.chdir(os.path.dirname(kernel_path))
     source_file = '%s/run_graph.cpp' % os.path.dirname(__file__)
@@ -18,17 +80,24 @@ def eval(kernel_path, **kwargs):
       if backend == 'c-rocm':
         assert 0 == os.system('timeout 10s /opt/rocm/bin/hipcc %s -std=c++17 -lpthread -o %s.tmp' % (source_file, evaluator_path)), "ROCm SDK is not found, please setup the graphcore environment."
       elif backend == 'c-cuda':
-        assert 0 == os.system('timeout 10s g++ %s -std=c++17 -lcuda -lcudart -lpthread -I/usr/local/cuda/include -L/usr/local/cuda/lib64 -o %s.tmp' % (source_file, evaluator_path)), "CUDA SDK is not found, please setup the graphcore environment."
+        cuda_home = os.environ.get('CUDA_HOME', '/usr/local/cuda')
+        assert 0 == os.system('timeout 10s g++ %s -std=c++17 -lcuda -lcudart -lpthread -I%s/include -L%s/lib64 -Wl,-rpath,%s/lib64 -o %s.tmp' % (source_file, cuda_home, cuda_home, cuda_home, evaluator_path)), "CUDA SDK is not found, please setup the graphcore environment."
       else:
         raise Exception("Unrecognized backend type for `%s`" % backend)
       os.system('mv %s.tmp %s >/dev/null 2>&1' % (evaluator_path, evaluator_path))
       assert os.path.exists(evaluator_path)
 
-    exec_cmd = "sh -c 'cd %s && CUDA_VISIBLE_DEVICES=%d EXPECTED_TIMEOUT=%s %s'" % (os.path.dirname(kernel_path), dev_id, kwargs['expected_timeout'], evaluator_path)
-    st, output = subprocess.getstatusoutput(exec_cmd)
-    os.chdir(curr_dir)
-    if st != 0:
-        raise Exception("Invalid runtime kernel execution: %s\n\nReason: %s" % (exec_cmd, output))
+    if os.environ.get('EVAL_DAEMON', '1') != '0':
+        try:
+            output = get_daemon(evaluator_path, dev_id).run(kernel_dir, {'EXPECTED_TIMEOUT': kwargs['expected_timeout']})
+        finally:
+            os.chdir(curr_dir)
+    else:
+        exec_cmd = "sh -c 'cd %s && CUDA_VISIBLE_DEVICES=%d EXPECTED_TIMEOUT=%s %s'" % (os.path.dirname(kernel_path), dev_id, kwargs['expected_timeout'], evaluator_path)
+        st, output = subprocess.getstatusoutput(exec_cmd)
+        os.chdir(curr_dir)
+        if st != 0:
+            raise Exception("Invalid runtime kernel execution: %s\n\nReason: %s" % (exec_cmd, output))
 
     results = {}
     for line in output.split('\n'):
@@ -3,11 +3,13 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <unordered_set>
 #include <unordered_map>
@@ -15,6 +17,7 @@
 #include <cassert>
 #include <cstring>
 #include <functional>
+#include <memory>
 #include <numeric>
 #include <pthread.h>
 #include <unistd.h>
@@ -26,6 +29,8 @@
 #define cuMemAlloc hipMalloc
 #define cuMemFree hipFree
 #define cuModuleLoad hipModuleLoad
+#define cuModuleUnload hipModuleUnload
+#define cuMemsetD32Async hipMemsetD32Async
 #define cuModuleGetFunction hipModuleGetFunction
 #define cuLaunchKernel hipModuleLaunchKernel
 #define cuMemAllocHost hipHostMalloc
@@ -103,37 +108,136 @@ std::vector<tensor_property> parse_properties(const std::string &encoded_inputs)
     return std::move(ret);
 }
 
-std::pair<void *, void *> create_tensor_memory(const tensor_property &tp) {
-    size_t num_elements = tp.element_size();
-    size_t type_size = tp.type_size();
+typedef std::unordered_map<std::string, std::string> options_t;
+
+// a request option, or the environment variable of the same name
+const char *get_option(const options_t &options, const std::string &key, const char *def_ret = nullptr) {
+    auto it = options.find(key);
+    if (it != options.end())
+        return it->second.c_str();
+    const char *val = getenv(key.c_str());
+    return val ? val : def_ret;
+}
+
+// Linear interpolation between closest ranks, `sorted` must not be empty.
+double percentile(const std::vector<double> &sorted, double q) {
+    double pos = q * (sorted.size() - 1);
+    size_t lo = size_t(pos), hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (sorted[hi] - sorted[lo]) * (pos - lo);
+}
+
+struct timing_stats {
+    double min, median, p95, mean, cv;
+};
+
+timing_stats summarize(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    timing_stats stats;
+    stats.min = samples.front();
+    stats.median = percentile(samples, 0.5);
+    stats.p95 = percentile(samples, 0.95);
+    stats.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    double var = 0.0;
+    for (auto it: samples)
+        var += (it - stats.mean) * (it - stats.mean);
+    var = samples.size() > 1 ? var / (samples.size() - 1) : 0.0;
+    stats.cv = stats.mean > 0 ? std::sqrt(var) / stats.mean : 0.0;
+    return stats;
+}
+
+// Host and device memory of one tensor argument, kept across the kernels that
+// a daemon evaluates. Inputs are only initialized again when their layout
+// changes, outputs are cleared for every kernel.
+struct tensor_memory {
+    std::string layout;
     void *hptr = nullptr, *dptr = nullptr;
-    assert(0 == cuMemAllocHost(&hptr, num_elements * type_size) && hptr != nullptr);
-    assert(0 == cuMemAlloc((CUdeviceptr*)&dptr, num_elements * type_size) && dptr != nullptr);
-    return {hptr, dptr};
+    size_t capacity = 0;
+
+    void reserve(size_t bytes) {
+        if (bytes <= capacity)
+            return;
+        release();
+        assert(0 == cuMemAllocHost(&hptr, bytes) && hptr != nullptr);
+        assert(0 == cuMemAlloc((CUdeviceptr*)&dptr, bytes) && dptr != nullptr);
+        capacity = bytes;
+    }
+
+    void release() {
+        if (capacity) {
+            assert(0 == cuMemFreeHost(hptr));
+            assert(0 == cuMemFree((CUdeviceptr)dptr));
+        }
+        hptr = dptr = nullptr, capacity = 0, layout.clear();
+    }
+};
+
+std::vector<tensor_memory> input_memory, output_memory, intermediate_memory;
+
+void prepare_input(tensor_memory &mem, const tensor_property &it, int i) {
+    size_t size = it.element_size(), byte_size = size * it.type_size();
+    std::string layout = it.dtype + "/" + std::to_string(byte_size) + "/" + std::to_string(i);
+    mem.reserve(byte_size);
+    if (mem.layout == layout)
+      return;
+    if (it.dtype == "int32") {
+      for (size_t x = 0; x < size; ++x)
+        ((int*)(mem.hptr))[x] = (x + i + 1) % 71;
+    } else if (it.dtype == "float32") {
+      for (size_t x = 0; x < size; ++x)
+        ((float*)(mem.hptr))[x] = (x + i + 1) % 71;
+    } else {
+      assert(byte_size % sizeof(int) == 0);
+      for (size_t x = 0; x < byte_size / sizeof(int); ++x)
+        ((int*)(mem.hptr))[x] = (x + i + 1) % 71;
+    }
+    if (mem.hptr != mem.dptr)
+      assert(0 == cuMemcpyHtoDAsync((CUdeviceptr)mem.dptr, mem.hptr, byte_size, nullptr));
+    mem.layout = layout;
 }
 
-void *timeout_monitor(void *arg) {
-    sleep(30);
-    printf("[FATAL] Time limit exceeded for this evaluation.\n");
-    _exit(1);
+void prepare_output(tensor_memory &mem, const tensor_property &it) {
+    size_t byte_size = it.element_size() * it.type_size();
+    mem.reserve(byte_size);
+    memset(mem.hptr, 0, byte_size);
+    if (mem.hptr != mem.dptr)
+      assert(0 == cuMemcpyHtoDAsync((CUdeviceptr)mem.dptr, mem.hptr, byte_size, nullptr));
 }
 
-int main(int argc, char** argv)
-{
-    pthread_t p_timeout_monitor;
-    pthread_create(&p_timeout_monitor, NULL, timeout_monitor, NULL);
-    pthread_detach(p_timeout_monitor);
+// Scratch memory of twice the device L2 capacity. Writing all of it evicts
+// the tensors from L2 without going through the host.
+struct l2_scratch {
+    CUdeviceptr dptr = 0;
+    size_t words = 0;
+    unsigned int value = 0;
 
+    void scrub() {
+      if (!words) {
+        int l2_bytes = 0;
 #if !defined(__HIPCC__)
-    CUcontext ctx;
-    if (0 != cuInit(0) || 0 != cuDevicePrimaryCtxRetain(&ctx, 0) || 0 != cuCtxSetCurrent(ctx))
-        throw std::runtime_error("GPU device for CUDA is not found.");
+        if (0 != cuDeviceGetAttribute(&l2_bytes, CU_DEVICE_ATTRIBUTE_L2_CACHE_SIZE, 0) || l2_bytes <= 0)
 #else
-    if (0 != hipSetDevice(0))
-        throw std::runtime_error("GPU device for ROCM is not found.");
+        if (0 != hipDeviceGetAttribute(&l2_bytes, hipDeviceAttributeL2CacheSize, 0) || l2_bytes <= 0)
 #endif
+          l2_bytes = 64 << 20;
+        words = 2 * size_t(l2_bytes) / sizeof(unsigned int);
+        assert(0 == cuMemAlloc(&dptr, words * sizeof(unsigned int)));
+      }
+      // a new value every time, so that the writes cannot be elided
+      assert(0 == cuMemsetD32Async(dptr, ++value, words, nullptr));
+    }
+} l2_scrubber;
+
+void *timeout_monitor(void *arg) {
+    sleep(30);
+    printf("[FATAL] Time limit exceeded for this evaluation.\n");
+    _exit(1);
+}
 
-    std::ifstream t("my_kernel.cc");
+// Measures the kernel of `kernel_dir`, i.e. its source my_kernel.cc and module my_kernel.out.
+void evaluate(const std::string &kernel_dir, const options_t &options) {
+    std::ifstream t(kernel_dir + "/my_kernel.cc");
+    if (!t)
+        throw std::runtime_error(("Failed to open kernel source in `" + kernel_dir + "`.").c_str());
     std::string source((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
     t.close();
 
@@ -141,60 +245,103 @@ int main(int argc, char** argv)
     auto params = ssplit(encoded_params, ":");
     auto inputs = parse_properties(params[0]), outputs = parse_properties(params[1]);
 
+    if (input_memory.size() < inputs.size())
+      input_memory.resize(inputs.size());
+    if (output_memory.size() < outputs.size())
+      output_memory.resize(outputs.size());
+
+    // buffers that kernels of the module pass to each other, one `// [intermediate] shape/dtype/name` line each
+    std::vector<tensor_property> intermediates;
+    for (int at = source.find("// [intermediate] "); at >= 0; at = source.find("// [intermediate] ", at + 1)) {
+      auto props = parse_properties(get_between(source.substr(at), "// [intermediate] ", "\n"));
+      intermediates.insert(intermediates.end(), props.begin(), props.end());
+    }
+    if (intermediate_memory.size() < intermediates.size())
+      intermediate_memory.resize(intermediates.size());
+
     std::vector<void*> h_args, d_args;
+    std::unordered_map<std::string, void*> named_args;
     for (int i = 0; i < inputs.size(); ++i) {
-      auto &it = inputs[i];
-      auto ptrs = create_tensor_memory(it);
-      h_args.push_back(ptrs.first);
-      d_args.push_back(ptrs.second);
-
-      size_t size = it.element_size();
-      if (it.dtype == "int32") {
-        for (size_t x = 0; x < size; ++x)
-          ((int*)(ptrs.first))[x] = (x + i + 1) % 71;
-      } else if (it.dtype == "float32") {
-        for (size_t x = 0; x < size; ++x)
-          ((float*)(ptrs.first))[x] = (x + i + 1) % 71;
-      } else {
-        size_t byte_size = size * it.type_size();
-        assert(byte_size % sizeof(int) == 0);
-        for (size_t x = 0; x < byte_size / sizeof(int); ++x)
-          ((int*)(ptrs.first))[x] = (x + i + 1) % 71;
-      }
-      if (ptrs.first != ptrs.second)
-        assert(0 == cuMemcpyHtoDAsync((CUdeviceptr)ptrs.second, ptrs.first, size * it.type_size(), nullptr));
+      prepare_input(input_memory[i], inputs[i], i);
+      h_args.push_back(input_memory[i].hptr);
+      d_args.push_back(input_memory[i].dptr);
+      named_args[inputs[i].name] = d_args.back();
+    }
+    for (int i = 0; i < outputs.size(); ++i) {
+      prepare_output(output_memory[i], outputs[i]);
+      h_args.push_back(output_memory[i].hptr);
+      d_args.push_back(output_memory[i].dptr);
+      named_args[outputs[i].name] = d_args.back();
     }
-    for (auto it: outputs) {
-      auto ptrs = create_tensor_memory(it);
-      h_args.push_back(ptrs.first);
-      d_args.push_back(ptrs.second);
-
-      memset(ptrs.first, 0, it.element_size() * it.type_size());
-      if (ptrs.first != ptrs.second)
-        assert(0 == cuMemcpyHtoDAsync((CUdeviceptr)ptrs.second, ptrs.first, it.element_size() * it.type_size(), nullptr));
+    for (size_t i = 0; i < intermediates.size(); ++i) {
+      intermediate_memory[i].reserve(intermediates[i].element_size() * intermediates[i].type_size());
+      named_args[intermediates[i].name] = intermediate_memory[i].dptr;
     }
 
-    auto function_name = get_between(source, " void ", "(", source.find("extern \"C\" __global__ "));
-    assert(function_name.size() > 0);
+    // A module holds one kernel, or a sequence of kernels that are launched in
+    // source order and timed as a whole. Each kernel carries its own thread
+    // extents; a sequence binds its arguments by parameter name.
+    struct kernel_launch {
+      std::string function_name;
+      CUfunction hfunc;
+      int bx, by, bz, tx, ty, tz;
+      std::vector<void*> args;
+      std::vector<void**> arg_ptrs;
+    };
+    std::vector<kernel_launch> kernels;
+    const std::string kernel_prefix = "extern \"C\" __global__ ";
+    for (int at = source.find(kernel_prefix); at >= 0; ) {
+      int next = source.find(kernel_prefix, at + 1);
+      bool single = (kernels.empty() && next < 0);
+      // a single kernel may have its annotations anywhere in the source
+      std::string kernel_source = single ? source : source.substr(at, next < 0 ? std::string::npos : next - at);
+      at = next;
 
-    int bx = std::atoi(get_between(source, "// [thread_extent] blockIdx.x =", "\n", 0, "1").c_str());
-    int by = std::atoi(get_between(source, "// [thread_extent] blockIdx.y =", "\n", 0, "1").c_str());
-    int bz = std::atoi(get_between(source, "// [thread_extent] blockIdx.z =", "\n", 0, "1").c_str());
-    int tx = std::atoi(get_between(source, "// [thread_extent] threadIdx.x =", "\n", 0, "1").c_str());
-    int ty = std::atoi(get_between(source, "// [thread_extent] threadIdx.y =", "\n", 0, "1").c_str());
-    int tz = std::atoi(get_between(source, "// [thread_extent] threadIdx.z =", "\n", 0, "1").c_str());
+      kernels.push_back(kernel_launch());
+      kernel_launch &k = kernels.back();
+      k.function_name = get_between(kernel_source, " void ", "(");
+      assert(k.function_name.size() > 0);
 
-    CUmodule hmod;
-    CUfunction hfunc;
-    assert(0 == cuModuleLoad(&hmod, "my_kernel.out"));
-    assert(0 == cuModuleGetFunction(&hfunc, hmod, function_name.c_str()));
+      k.bx = std::atoi(get_between(kernel_source, "// [thread_extent] blockIdx.x =", "\n", 0, "1").c_str());
+      k.by = std::atoi(get_between(kernel_source, "// [thread_extent] blockIdx.y =", "\n", 0, "1").c_str());
+      k.bz = std::atoi(get_between(kernel_source, "// [thread_extent] blockIdx.z =", "\n", 0, "1").c_str());
+      k.tx = std::atoi(get_between(kernel_source, "// [thread_extent] threadIdx.x =", "\n", 0, "1").c_str());
+      k.ty = std::atoi(get_between(kernel_source, "// [thread_extent] threadIdx.y =", "\n", 0, "1").c_str());
+      k.tz = std::atoi(get_between(kernel_source, "// [thread_extent] threadIdx.z =", "\n", 0, "1").c_str());
 
-    std::vector<void**> kernel_args(d_args.size());
-    for (int i = 0; i < d_args.size(); ++i)
-      kernel_args[i] = &d_args[i];
+      if (single) {
+        k.args = d_args;
+        break;
+      }
+      for (auto param: ssplit(get_between(kernel_source, " " + k.function_name + "(", ")"), ",")) {
+        int end = param.find_last_not_of(" \t\n");
+        if (end < 0)
+          continue;
+        int begin = param.find_last_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_", end) + 1;
+        auto name = param.substr(begin, end + 1 - begin);
+        if (!named_args.count(name))
+          throw std::runtime_error(("Argument `" + name + "` of kernel `" + k.function_name + "` is not a known tensor.").c_str());
+        k.args.push_back(named_args[name]);
+      }
+    }
+    if (kernels.empty())
+        throw std::runtime_error("No kernel function is found in kernel source.");
+
+    CUmodule hmod;
+    if (0 != cuModuleLoad(&hmod, (kernel_dir + "/my_kernel.out").c_str()))
+        throw std::runtime_error(("Failed to load kernel module in `" + kernel_dir + "`.").c_str());
+    // the daemon outlives the module, unload it on every way out
+    std::unique_ptr<void, std::function<void(void*)>> module_guard(hmod, [](void *hmod) { cuModuleUnload((CUmodule)hmod); });
+    for (auto &k: kernels) {
+      if (0 != cuModuleGetFunction(&k.hfunc, hmod, k.function_name.c_str()))
+        throw std::runtime_error(("Kernel function `" + k.function_name + "` is not found in module.").c_str());
+      for (auto &arg: k.args)
+        k.arg_ptrs.push_back(&arg);
+    }
 
     auto launch_kernel = [&]() -> void {
-      assert(0 == cuLaunchKernel(hfunc, bx, by, bz, tx, ty, tz, 0, nullptr, (void**)kernel_args.data(), nullptr));
+      for (auto &k: kernels)
+        assert(0 == cuLaunchKernel(k.hfunc, k.bx, k.by, k.bz, k.tx, k.ty, k.tz, 0, nullptr, (void**)k.arg_ptrs.data(), nullptr));
     };
 
     launch_kernel();
@@ -220,10 +367,12 @@ int main(int argc, char** argv)
       printf("- K/%d: %.10e\n", c, digest);
     }
 
-    CUevent hStart, hStop;
+    static CUevent hStart = nullptr, hStop = nullptr;
     float ms;
-    assert(0 == cuEventCreate(&hStart, 0));
-    assert(0 == cuEventCreate(&hStop, 0));
+    if (!hStart) {
+      assert(0 == cuEventCreate(&hStart, 0));
+      assert(0 == cuEventCreate(&hStop, 0));
+    }
 
     assert(0 == cuEventRecord(hStart, nullptr));
     launch_kernel();
@@ -232,20 +381,82 @@ int main(int argc, char** argv)
     assert(0 == cuEventElapsedTime(&ms, hStart, hStop));
     float tpr = ms * 1e-3;
 
-    const char *expected_timeout = getenv("EXPECTED_TIMEOUT");
+    const char *expected_timeout = get_option(options, "EXPECTED_TIMEOUT");
     if (expected_timeout && *expected_timeout && tpr > std::atof(expected_timeout)) {
         throw std::runtime_error(("Time limit exceeded: " + std::to_string(tpr) + " v.s. (expected) " + expected_timeout).c_str());
     }
 
+    std::string flush_mode = get_option(options, "FLUSH_MEM", "");
+    if (flush_mode == "0")
+      flush_mode.clear();
+    bool flush_global_memory = !flush_mode.empty();
+    // runs before the start event of every cold launch
+    auto flush = [&]() -> void {
+      if (flush_mode == "upload") {
+        for (int j = 0; j < inputs.size(); ++j)
+           assert(0 == cuMemcpyHtoDAsync((CUdeviceptr)d_args[j], h_args[j], inputs[j].element_size() * inputs[j].type_size(), nullptr));
+      } else
+        l2_scrubber.scrub();
+    };
+
+    if (std::string(get_option(options, "EVAL_TIMING", "")) == "samples") {
+      // Every sample is timed by its own pair of events, a round of samples is
+      // queued back to back and read after a single synchronization. Launches
+      // too short for the event resolution are timed in batches.
+      double budget = std::atof(get_option(options, "EVAL_TIME_BUDGET", "1.0"));
+      double target_cv = std::atof(get_option(options, "EVAL_TARGET_CV", "0.02"));
+      size_t min_samples = std::max(3, std::atoi(get_option(options, "EVAL_MIN_SAMPLES", "10")));
+      const size_t max_samples = 100000;
+      int batch = flush_global_memory ? 1 : std::max(1, std::min(1000, int(5e-5 / std::max(tpr, 1e-9f))));
+      // a round takes about 0.1 sec, so that the budget is checked often enough
+      int round = std::max(1, std::min(32, int(0.1 / (std::max(tpr, 1e-9f) * batch))));
+
+      static std::vector<CUevent> sample_events;
+      while (sample_events.size() < size_t(2 * round)) {
+        sample_events.push_back(nullptr);
+        assert(0 == cuEventCreate(&sample_events.back(), 0));
+      }
+
+      std::vector<double> samples;
+      timing_stats stats;
+      auto start = std::chrono::steady_clock::now();
+      while (true) {
+        for (int i = 0; i < round; ++i) {
+          if (flush_global_memory)
+            flush();
+          assert(0 == cuEventRecord(sample_events[2 * i], nullptr));
+          for (int b = 0; b < batch; ++b)
+            launch_kernel();
+          assert(0 == cuEventRecord(sample_events[2 * i + 1], nullptr));
+        }
+        assert(0 == cuStreamSynchronize(nullptr));
+        for (int i = 0; i < round; ++i) {
+          assert(0 == cuEventElapsedTime(&ms, sample_events[2 * i], sample_events[2 * i + 1]));
+          samples.push_back(ms * 1e-3 / batch);
+        }
+        stats = summarize(samples);
+        double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start).count();
+        if (samples.size() >= min_samples && stats.cv <= target_cv)
+          break;
+        if (samples.size() >= max_samples || elapsed >= budget)
+          break;
+      }
+      printf("- TPR: %g\n", stats.mean);
+      printf("- TPR_MIN: %g\n", stats.min);
+      printf("- TPR_MEDIAN: %g\n", stats.median);
+      printf("- TPR_P95: %g\n", stats.p95);
+      printf("- TPR_CV: %g\n", stats.cv);
+      printf("- SAMPLES: %zu\n", samples.size());
+      return;
+    }
+
     int num_runs = std::max(1, std::min(10000, int(1.0 / tpr)));
-    bool flush_global_memory = (getenv("FLUSH_MEM") != nullptr);
 
     tpr = 0.0f;
     if (flush_global_memory) {
-      num_runs = 10;
+      num_runs = std::max(1, std::atoi(get_option(options, "EVAL_FLUSH_RUNS", "10")));
       for (int i = 0; i < num_runs; ++i) {
-        for (int j = 0; j < inputs.size(); ++j)
-           assert(0 == cuMemcpyHtoDAsync((CUdeviceptr)d_args[j], h_args[j], inputs[j].element_size() * inputs[j].type_size(), nullptr));
+        flush();
         assert(0 == cuEventRecord(hStart, nullptr));
         launch_kernel();
         assert(0 == cuEventRecord(hStop, nullptr));
@@ -264,10 +475,76 @@ int main(int argc, char** argv)
       tpr = ms * 1e-3 / num_runs;
     }
     printf("- TPR: %g\n", tpr);
+}
+
+// With `--daemon`, the evaluator keeps its device context and tensor buffers
+// alive and reads one request per line from stdin:
+//
+//   <kernel_dir> [KEY=VAL ..]
+//
+// The reply has the same lines as a single evaluation, an `[ERROR] ..` line
+// if the kernel is rejected, and ends with [DONE]. Options (EXPECTED_TIMEOUT,
+// FLUSH_MEM, EVAL_*) override environment variables. The caller enforces the
+// time limit: a kernel that hangs or faults makes it restart the daemon.
+//
+// FLUSH_MEM times launches with a cold L2: the evaluator writes a scratch
+// buffer of twice the L2 capacity before each timed launch, or with
+// FLUSH_MEM=upload copies all inputs from the host again. Without sampling,
+// EVAL_FLUSH_RUNS (default 10) cold launches are timed.
+//
+// TPR is the mean of `num_runs` back to back launches, unless EVAL_TIMING is
+// `samples`: then samples are collected until their coefficient of variation
+// is at most EVAL_TARGET_CV (default 0.02) after EVAL_MIN_SAMPLES (default 10)
+// samples, or until EVAL_TIME_BUDGET seconds (default 1.0) are spent. TPR is
+// the mean of the samples, and TPR_MIN/MEDIAN/P95/CV and SAMPLES are reported
+// as well.
+int main(int argc, char** argv)
+{
+    bool daemon = (argc > 1 && std::string(argv[1]) == "--daemon");
+    if (!daemon) {
+      pthread_t p_timeout_monitor;
+      pthread_create(&p_timeout_monitor, NULL, timeout_monitor, NULL);
+      pthread_detach(p_timeout_monitor);
+    }
+
+#if !defined(__HIPCC__)
+    CUcontext ctx;
+    if (0 != cuInit(0) || 0 != cuDevicePrimaryCtxRetain(&ctx, 0) || 0 != cuCtxSetCurrent(ctx))
+        throw std::runtime_error("GPU device for CUDA is not found.");
+#else
+    if (0 != hipSetDevice(0))
+        throw std::runtime_error("GPU device for ROCM is not found.");
+#endif
+
+    if (!daemon) {
+      evaluate(".", {});
+    } else {
+      std::string line;
+      while (std::getline(std::cin, line)) {
+        auto items = ssplit(line, " ");
+        if (items[0].empty())
+          continue;
+        options_t options;
+        for (size_t i = 1; i < items.size(); ++i) {
+          auto at = items[i].find('=');
+          if (at != std::string::npos)
+            options[items[i].substr(0, at)] = items[i].substr(at + 1);
+        }
+        try {
+          evaluate(items[0], options);
+        } catch (std::exception &e) {
+          printf("[ERROR] %s\n", e.what());
+        }
+        printf("[DONE]\n");
+        fflush(stdout);
+      }
+    }
 
-    for (auto &it: h_args)
-      assert(0 == cuMemFreeHost(it));
-    for (auto &it: d_args)
-      assert(0 == cuMemFree((CUdeviceptr)it));
+    for (auto &it: input_memory)
+      it.release();
+    for (auto &it: output_memory)
+      it.release();
+    for (auto &it: intermediate_memory)
+      it.release();
     return 0;
 }